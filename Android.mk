@@ -10,8 +10,12 @@ LOCAL_C_INCLUDES += \
 LOCAL_SRC_FILES := src/main.cpp \
         src/rc_utils.cpp \
         src/air_service.cpp \
+        src/sbus_output.cpp \
+        src/sbus_codec.cpp \
+        src/sbus_decoder.cpp \
         src/gnd_service.cpp \
         src/config_loader.cpp \
+        src/config_schema.cpp \
         src/handler.cpp \
         src/event_handler.cpp \
         src/key_config_manager.cpp \
@@ -30,8 +34,11 @@ LOCAL_STATIC_LIBRARIES := \
 
 LOCAL_CFLAGS := -DLOG_TAG=\"rc_service\"
 LOCAL_CFLAGS += -Wunused-parameter
+LOCAL_CPPFLAGS += -std=c++17
 
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE_PATH := $(TARGET_OUT_EXECUTABLES)
 
 include $(BUILD_EXECUTABLE)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
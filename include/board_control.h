@@ -19,6 +19,8 @@
 
 #include <string>
 #include "config_loader.h"
+#include "config_schema.h"
+#include "rcu_ptr.h"
 
 class BoardControl
 {
@@ -32,24 +34,51 @@ public:
                 int pwm_period;
                 int pwm_duty;
                 int sbus_channel;
+                /* sysfs attributes, kept open for the lifetime of the device */
+                int duty_fd;
+                int period_fd;
+                int enable_fd;
             };
             /* other type device attr */
         };
     } DevInfo_t;
 
+    typedef struct {
+        int period;
+        /* sbus channel from 1, 0 is unused */
+        int channel;
+    } PwmSettings_t;
+
+    typedef struct {
+        /* bumped by every load, tells controlDev to reapply */
+        uint32_t generation;
+        PwmSettings_t pwm[2];
+    } Settings_t;
+
     BoardControl(const string &filename);
     ~BoardControl();
-    int mControlSbus;
+    bool isValid();
+    /* re-read the pwm sections, the devices follow on the next controlDev */
+    bool reloadSettings();
     void controlDev(uint8_t data[][25]);
 private:
     DevInfo_t *mDevInfo;
     ConfigLoader *mLoader;
     string mFileName;
     uint16_t mSbusChannelData[16];
+    RcuPtr<Settings_t> mSettings;
+    uint32_t mGeneration;
+    /* generation of the settings the devices run with */
+    uint32_t mAppliedGeneration;
 
     bool parseSbusData(uint8_t data[][25]);
-    void loadSettings();
-    bool initPwmDev(int port, int period);
+    bool loadSettings();
+    void applySettings(const Settings_t *settings);
+
+    static const ConfigField_t sPwmFields[];
+    bool mValid;
+    bool initPwmDev(DevInfo_t *dev);
+    void closePwmDev(DevInfo_t *dev);
 };
 
 #endif
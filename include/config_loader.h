@@ -18,14 +18,24 @@
 #define CONFIGLOADER_H
 
 #include <fstream>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <string>
+#include <string_view>
 #include <map>
 #include <list>
+#include <vector>
 
 using namespace std;
 
+/*
+ * The file is read into one buffer and parsed once. Sections, keys and
+ * values are views into that buffer (values are NUL terminated in
+ * place), and lookups go through an open addressing hash of
+ * (section, key). Reloading reuses the buffer and the tables, so the
+ * getters and a reload of an unchanged file don't allocate.
+ */
 class ConfigLoader
 {
 public:
@@ -37,17 +47,37 @@ public:
     float getFloat(const char *key, const float &default_value = 0);
     bool getBool(const char *key, const bool &default_value = false);
     string getStr(const char *key, const string &default_value);
-    void beginSection(const string &section);
+    /* valid until the next loadConfig() */
+    string_view getStrView(const char *key, string_view default_value = string_view());
+    /* raw value of key, false if it is missing */
+    bool lookup(const char *key, string_view &value);
+    void beginSection(string_view section);
     void endSection();
     list<string> getSectionKeys();
 
 private:
-    bool isSpace(char c);
-    void trim(string &str);
-    bool parseLine(const string &line, string &section, string &key, string &value);
+    struct Entry {
+        string_view section;
+        string_view key;
+        string_view value;
+    };
+
+    static bool isSpace(char c);
+    static string_view trim(string_view str);
+    static uint32_t hash(string_view section, string_view key);
+    bool readFile(const string &filename);
+    void parseLine(char *line, size_t len, string_view &section);
+    void addEntry(string_view section, string_view key, string_view value);
+    uint32_t *findSlot(string_view section, string_view key);
+    const Entry *find(const char *key);
 
-    map<string, map<string, string>> _settings;
-    map<string, string> _curSection;
+    string _buffer;
+    vector<Entry> _entries;
+    vector<string_view> _sections;
+    /* entry index + 1 per slot, 0 is empty */
+    vector<uint32_t> _index;
+    string_view _curSection;
+    bool _hasSection;
 };
 
 #endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CONFIG_SCHEMA_H
+#define CONFIG_SCHEMA_H
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "config_loader.h"
+
+typedef enum {
+    CONFIG_INT,
+    CONFIG_FLOAT,
+    CONFIG_BOOL,
+    /* char array, the value must fit including the terminator */
+    CONFIG_STR,
+    /* int, the value is one of the names in enums */
+    CONFIG_ENUM,
+} ConfigType_t;
+
+/* a missing key leaves the field untouched instead of setting the default */
+#define CONFIG_KEEP 0x01
+
+typedef struct {
+    const char *name;
+    int value;
+} ConfigEnum_t;
+
+/*
+ * One key bound to one struct member. When ConfigSchema::bind() is given
+ * an index, a %d in section and key is replaced by it. A NULL section
+ * means the section given to bind().
+ */
+typedef struct {
+    const char *section;
+    const char *key;
+    ConfigType_t type;
+    size_t offset;
+    size_t size;
+    double def;
+    double min;
+    double max;
+    /* default of CONFIG_STR and CONFIG_ENUM */
+    const char *defStr;
+    const ConfigEnum_t *enums;
+    unsigned flags;
+} ConfigField_t;
+
+#define CONFIG_MEMBER(type, member) offsetof(type, member), sizeof(((type *)0)->member)
+
+#define CONFIG_FIELD_INT(section, key, type, member, def, min, max) \
+    { section, key, CONFIG_INT, CONFIG_MEMBER(type, member), def, min, max, NULL, NULL, 0 }
+#define CONFIG_FIELD_FLOAT(section, key, type, member, def, min, max) \
+    { section, key, CONFIG_FLOAT, CONFIG_MEMBER(type, member), def, min, max, NULL, NULL, 0 }
+#define CONFIG_FIELD_BOOL(section, key, type, member, def) \
+    { section, key, CONFIG_BOOL, CONFIG_MEMBER(type, member), def, 0, 1, NULL, NULL, 0 }
+#define CONFIG_FIELD_STR(section, key, type, member, def) \
+    { section, key, CONFIG_STR, CONFIG_MEMBER(type, member), 0, 0, 0, def, NULL, 0 }
+#define CONFIG_FIELD_ENUM(section, key, type, member, def, enums) \
+    { section, key, CONFIG_ENUM, CONFIG_MEMBER(type, member), 0, 0, 0, def, enums, 0 }
+
+/*
+ * Fills settings structs from a loaded config file by a field table.
+ * Malformed and out of range values are collected rather than stopping
+ * at the first one, so a bad file is reported completely. Fields with
+ * a bad value keep their default.
+ */
+class ConfigSchema
+{
+public:
+    ConfigSchema(ConfigLoader *loader, const string &filename);
+
+    void bind(const ConfigField_t *fields, size_t count, void *base, const char *section = NULL, int index = -1);
+    /* record a check across fields */
+    void error(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+    bool ok() const;
+    /* log every collected error, returns ok() */
+    bool report() const;
+
+private:
+    bool bindField(const ConfigField_t *field, uint8_t *dst, const char *section, const char *key);
+
+    ConfigLoader *mLoader;
+    string mFileName;
+    vector<string> mErrors;
+};
+
+#endif
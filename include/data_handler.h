@@ -20,6 +20,7 @@
 #include "service.h"
 #include "handler.h"
 #include "message_sender.h"
+#include "sbus_decoder.h"
 
 using namespace std;
 
@@ -34,21 +35,32 @@ public:
 
 private:
     static void *pollThreadFunc(void *arg);
-    static void timerNotifyCb(union sigval val);
     void startPollThread();
-    void initTimer();
+    int  initPPMTimer();
+    void armPPMTimer();
     void handleUevent(int ufd);
+    void decodeSbusData(int sbus, const uint8_t *data, size_t len);
     void updateSbusState(char *state);
     void setSbusEnabled(int index, bool enabled);
     void updatePPMState(char *state);
+    bool readPPMData(int ppm);
     int  readAndSendPPMData();
+    void handlePPMEvent(int ppm);
     void setPPMEnabled(int index, bool enabled);
-    bool getPPMEnabled(int index);
 
+    /* all owned by the poll thread */
     int mSbusFds[2];
-    timer_t mTimer;
+    SbusDecoder mSbusDecoders[2];
+    int64_t mSbusStatsNs[2];
     uint8_t mPPMMask;
-    pthread_mutex_t mPPMLock;
+    /* ppm inputs whose driver signals changes through sysfs_notify */
+    uint8_t mPPMNotifyMask;
+    /* ppm inputs read at least once since their attribute was opened */
+    uint8_t mPPMReadMask;
+    /* sysfs attributes kept open while the input is enabled */
+    int mPPMFds[2];
+    int mPPMTimerFd;
+    bool mPPMTimerArmed;
 };
 
 #endif
@@ -17,7 +17,9 @@
 #ifndef EVENTHANDLER_H
 #define EVENTHANDLER_H
 
+#include <atomic>
 #include <map>
+#include <vector>
 #include "service.h"
 #include "handler.h"
 #include "key_config_manager.h"
@@ -39,12 +41,14 @@ class EventHandler : public Handler
 public:
     enum {
         ACTION_UP = 0,
-        ACTION_DOWN = 1
+        ACTION_DOWN = 1,
+        ACTION_REPEAT = 2
     };
 
     struct KeyState{
         int keyCode;
-        long pressedTime;
+        /* monotonic time the long press fires at, 0 when not armed */
+        int64_t longPressDeadline;
         bool isPressed;
         bool isLongPress;
     };
@@ -64,43 +68,55 @@ public:
     int getInputDeviceFds(int **fds);
     void handleKeyEvent(int keycode, int action);
     void handleAxisEvent(int axiscode, int value);
+    void handleSyncEvent();
+    void syncAxisValues(int fd);
     void handleConfigEvent(const char *filename);
 
 private:
-    static void *longPressThreadFunc(void *arg);
     static void *pollThreadFunc(void *arg);
+    static void *reloadThreadFunc(void *arg);
 
     int scanDir(const char *dirname);
     int findDevice(const char *devicePath);
     int getAxisInfo(int fd);
-    void startLongPressThread();
+    int startLongPressTimer();
+    void armLongPressTimer();
+    void handleLongPressTimer();
     void startPollThread();
+    int startReloadThread();
 
     void setKeyChannelDefaultValues();
     void setChannelValue(int sbus, int ch, int value);
     bool getChannelValue(int keyCode, KeyConfigManager::KeyAction_t action, int *sbus, int *ch, int *value);
     void notifyConfigChange();
 
-    void updateJoystickChannelValues();
+    void updateJoystickChannelValues(int steps);
     bool getScrollWheelSetting(int *sbus, int *channel);
-    void getJoystickControls(Controls_t *controls);
     int getFunctionChannel(int function);
-    void setManualControl(Controls_t controls);
-    uint16_t adjustRange(uint16_t value, float half);
 
     int *mDeviceFds;
     int mDeviceNum;
     map<string, int> mDeviceFdMap;
-    map<int, struct KeyState> mKeyStatesMap;
+    /* indexed by KeyConfigManager::getKeySlot */
+    vector<struct KeyState> mKeyStates;
+    /* key states and key channels, against the reload thread */
     pthread_mutex_t mLock;
+    /* fires at the earliest long press deadline, -1 with long press disabled */
+    int mLongPressFd;
 
     KeyConfigManager *mKeyConfig;
     JoystickConfigManager *mJoystickConfig;
+    /* config files waiting to be parsed by the reload thread */
+    std::atomic<unsigned> mReloadPending;
+    int mReloadFd;
 
     static int sAxisCodes[];
     map<int, struct AxisInfo> mAxisInfoMap;
     int mAxisCount;
     int *mAxisValues;
+    /* an axis moved since the last SYN_REPORT */
+    /* axis events since the last joystick update */
+    int mAxisEvents;
 };
 
 #endif
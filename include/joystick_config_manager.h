@@ -18,14 +18,17 @@
 #define JOYSTICKCONFIGMANAGER_H
 
 #include "config_loader.h"
+#include "config_schema.h"
+#include "rcu_ptr.h"
 
-typedef struct {
-    float roll;
-    float pitch;
-    float yaw;
-    float throttle;
-    float wheel;
-} Controls_t;
+/*
+ * raw axis values are -32768..32767, one lut point every 1 << JOYSTICK_LUT_SHIFT,
+ * about as many points as the 11 bit channel has values
+ */
+#define JOYSTICK_LUT_SHIFT  5
+#define JOYSTICK_LUT_POINTS ((65536 >> JOYSTICK_LUT_SHIFT) + 1)
+/* lut entries are channel values in fixed point with this many fraction bits, 2047 still fits int16 */
+#define JOYSTICK_LUT_FRAC   4
 
 class JoystickConfigManager
 {
@@ -57,45 +60,61 @@ public:
         ThrottleModeMax
     } ThrottleMode_t;
 
+    typedef struct Settings_t {
+        bool            calibrated;
+        int             transmitterMode;
+        Calibration_t   calibrations[maxFunction];
+        int             functionAxis[maxFunction];
+        int             functionChannels[maxFunction];
+        /* min and max value of functions */
+        int             minChannelValue;
+        int             maxChannelValue;
+        float           exponential;
+        bool            accumulator;
+        bool            deadband;
+        bool            centerZeroSupport;
+        int             throttleMode;
+        bool            negativeThrust;
+        float           frequency;
+        bool            circleCorrection;
+        /* whole pipeline of each function, sampled from the float path at load */
+        int16_t         lut[maxFunction][JOYSTICK_LUT_POINTS];
+    } Settings_t;
+
+    bool isValid();
+    /* parses the file, call from the config reload thread only */
     void reloadSettings();
     void setAxisValue(int axis, int value);
     int getFunctionChannel(int function);
-    void getJoystickControls(Controls_t *controls);
-    int getMinChannelValue();
-    int getMaxChannelValue();
+    /*
+     * channel value of every function for the current axis values. The
+     * accumulator throttle integrates once per step, pass the number of
+     * axis events folded into this update.
+     */
+    void getChannelValues(uint16_t values[maxFunction], int steps);
     float getMessageFrequency();
 
 private:
-    void loadSettings();
+    bool loadSettings();
     int mapFunctionMode(int mode, int function);
     void remapAxes(int currentMode, int newMode, int (&newMapping)[maxFunction]);
     float adjustRange(int value, Calibration_t calibration, bool withDeadbands);
+    float normalizeAxis(const Settings_t &s, int function, int value);
+    float shapeAxis(const Settings_t &s, int function, float value);
+    float mapChannel(const Settings_t &s, int function, float value);
+    void buildLut(Settings_t *s);
 
-    static const char*  sFunctionSettingsKey[maxFunction];
-    bool mCalibrated;
-    int mTransmitterMode;
-
-    Calibration_t *mCalibrations;
-    int mFunctionAxis[maxFunction];
-    int mFunctionChannels[4];
-
-    float mExponential;
-    bool mAccumulator;
-    bool mDeadband;
-    bool mCenterZeroSupport;
-    ThrottleMode_t mThrottleMode;
-    bool mNegativeThrust;
-    float mFrequency;
-    bool mCircleCorrection;
+    static const ConfigField_t sSettingsFields[];
+    static const ConfigField_t sCalibrationFields[];
 
-    /* min and max value of functions */
-    int mMinChannelValue;
-    int mMaxChannelValue;
+    RcuPtr<Settings_t> mSettings;
+    bool mValid;
 
     string mFileName;
     ConfigLoader *mLoader;
     int mAxisCount;
     int *mAxisValues;
+    float mThrottleAccu;
 };
 
 #endif
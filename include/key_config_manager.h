@@ -19,7 +19,13 @@
 
 #include <map>
 #include <string>
+#include <vector>
 #include "config_loader.h"
+#include "config_schema.h"
+#include "rcu_ptr.h"
+#include "service.h"
+
+class MessageSender;
 
 class KeyConfigManager
 {
@@ -45,6 +51,8 @@ public:
         int value;
         int switchType;
         int defaultValue;
+        /* hold time until the long press fires, long press sections only */
+        int longPressMs;
     } KeySetting_t;
 
     typedef struct
@@ -53,26 +61,45 @@ public:
         int channel;
     } ScrollWheelSetting_t;
 
-    KeyConfigManager(const string &filename, map<int, string> available_keys);
+    typedef struct
+    {
+        /* short and long press setting of each key slot, see getKeySlot */
+        vector<KeySetting_t> keySettings;
+        ScrollWheelSetting_t scrollWheel;
+    } Settings_t;
+
+    /* toggle keys read the channel values they flip from sender */
+    KeyConfigManager(const string &filename, map<int, string> available_keys, MessageSender *sender);
     ~KeyConfigManager();
+    bool isValid();
+    int getKeyCount();
+    /* dense index of a supported key code, -1 for any other code */
+    int getKeySlot(int keyCode);
+    /* parses the file, call from the config reload thread only */
     void reloadSettings();
     bool getChannelValue(int keyCode, KeyAction_t action, int* sbus, int* channel, int* value);
     bool getScrollWheelSetting(int *sbus, int *channel);
+    int getLongPressMs(int keyCode);
     /* get all channels and default values already configured to keys */
     map<int, int> getSbusDefaultValues(int sbus);
 
 private:
-    void loadSettings();
-    string getKeyActionStr(int keyCode, int action);
+    bool loadSettings();
     int currentChannelValue(int sbus, int channel);
 
     string mFileName;
+    MessageSender *mSender;
     ConfigLoader *mLoader;
     int mKeyCount;
     map<int, string> mAvailableKeys;
     string *mKeyActionNames;
-    map<string, KeySetting_t> mKeySettingsMap;
-    ScrollWheelSetting_t mScrollWheelSetting;
+    int16_t mKeySlots[KEY_CODE_MAX + 1];
+    RcuPtr<Settings_t> mSettings;
+    bool mValid;
+
+    static const ConfigField_t sKeyFields[];
+    static const ConfigField_t sLongPressFields[];
+    static const ConfigField_t sScrollWheelFields[];
 };
 
 #endif
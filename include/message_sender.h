@@ -17,36 +17,119 @@
 #ifndef MESSAGESENDER_H
 #define MESSAGESENDER_H
 
+#include <atomic>
+#include <pthread.h>
 #include "service.h"
+#include "seqlock.h"
 
 class EventHandler;
 
 class MessageSender
 {
 public:
-    MessageSender(int sbusNum);
+    enum SendMode {
+        /* both frames once per period */
+        SEND_PERIODIC,
+        /* right after a channel change, rate limited, plus a heartbeat per period */
+        SEND_ON_CHANGE
+    };
+
+    /* send rounds of the last completed stats interval */
+    typedef struct {
+        int64_t periodNs;
+        uint64_t rounds;
+        /* rounds sent for a channel change rather than the period */
+        uint64_t changeRounds;
+        /* periods skipped because a round started more than a period late */
+        uint64_t overruns;
+        int64_t minIntervalNs;
+        int64_t avgIntervalNs;
+        int64_t maxIntervalNs;
+        int64_t maxLateNs;
+    } SendStats_t;
+
+    /* channel values of both sbus streams, sbus and channel from 1 */
+    typedef struct {
+        uint16_t values[2][16];
+    } ChannelFrame_t;
+
+    MessageSender(int sbusNum, int msgVersion);
     ~MessageSender();
 
-    static void setChannelValue(int sbus, int ch, uint16_t value);
-    static int getChannelValue(int sbus, int ch);
+    /*
+     * Channel updates are transactions: values set between beginUpdate()
+     * and commitUpdate() become visible to the sender together. Writers
+     * are serialized, readers never wait for them.
+     */
+    void beginUpdate();
+    void updateChannelValue(int sbus, int ch, uint16_t value);
+    void commitUpdate();
+    /* one value as its own transaction */
+    void setChannelValue(int sbus, int ch, uint16_t value);
+    int getChannelValue(int sbus, int ch);
+    /* coherent copy of all channels, returns its version */
+    uint32_t getChannelFrame(ChannelFrame_t *frame);
     int openSocket(const char *ip, unsigned long port);
+    /* call before any channel update and before startThread() */
+    void setSendMode(SendMode mode, float maxFrequency);
     void startThread();
+    /* takes effect at the next period boundary */
     void setMessageFrequency(float freq) { mFrequency = freq; }
+    void getSendStats(SendStats_t *stats);
     int sendMessage();
     int sendMessage(int sbus);
     int sendMessage(int sbus, uint8_t (&data)[25]);
     int sendMessage(struct rc_msg *msg);
+    /* the sbus streams set in sbusMask, packed from one snapshot */
+    int sendMessages(uint32_t sbusMask);
+    /* one sendmmsg() for all, returns the number sent or -1 */
+    int sendMessages(const struct rc_msg *msgs, int count);
+    /* datagrams that failed to go out since startup */
+    uint64_t getSendErrors() { return mSendErrors; }
 
 private:
     static void *threadLoop(void *arg);
+    int64_t periodNs();
+    void run();
+    void sendRound();
+    void recordRound(int64_t now, int64_t lateNs, bool change);
+    void reportSendError(int err, int lost);
 
     int mSocketFd;
     struct sockaddr_in mSockaddr;
 
-    float mFrequency;
+    std::atomic<float> mFrequency;
     int mSendSbusNum;
+    int mMsgVersion;
+    /* failed datagrams, and the time and count at the last error log */
+    std::atomic<uint64_t> mSendErrors;
+    std::atomic<int64_t> mLastErrorLogNs;
+    std::atomic<uint64_t> mLoggedErrors;
+    /* v2 sequence number of each sbus stream */
+    std::atomic<uint32_t> mSeq[SBUS_MAX_PORTS];
+    SendMode mSendMode;
+    /* SEND_ON_CHANGE: minimum spacing of two rounds */
+    int64_t mMinGapNs;
+    /* written by commitUpdate() on a change in SEND_ON_CHANGE */
+    int mWakeFd;
+    int mTimerFd;
+
+    /* send thread only */
+    struct rc_msg mPackedMsgs[2];
+    uint32_t mPackedVersion;
+    int64_t mLastSendNs;
+    int64_t mLastStatsNs;
+    SendStats_t mStats;
+    int64_t mIntervalSumNs;
+    uint64_t mIntervalCount;
+    /* published at the end of each stats interval */
+    Seqlock<SendStats_t> mLastStats;
 
-    static uint16_t mChannelValues[2][16];
+    /* writers build the next frame here under mUpdateLock */
+    pthread_mutex_t mUpdateLock;
+    ChannelFrame_t mPendingFrame;
+    bool mPendingChanged;
+    Seqlock<ChannelFrame_t> mChannels;
 };
 
 #endif
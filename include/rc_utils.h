@@ -17,17 +17,26 @@
 #ifndef RC_UTILS_H
 #define RC_UTILS_H
 
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
 #include <termios.h>
 #include <sys/epoll.h>
+#include <string>
 
 int sbus_port_init(const char *sbus_port);
 int tty_port_init(const char *tty_port);
-int add_epoll_fd(int epoll_fd, int device_fd, epoll_data_t data);
+int add_epoll_fd(int epoll_fd, int device_fd, epoll_data_t data, uint32_t events = EPOLLIN);
 int del_epoll_fd(int epoll_fd, int device_fd);
 
 bool setValue(const std::string &filename, int value);
 bool getValue(const std::string &filename, int *value);
+int sysfs_attr_open(const char *path, int flags = O_WRONLY);
+bool sysfs_attr_write(int fd, int value);
+int sysfs_attr_read(int fd, int *values, int count);
 void pack_rc_msg(int sbus, uint16_t (&channels)[16], struct rc_msg *msg);
+void pack_rc_msg_v2(const struct rc_msg *msg, uint32_t seq, uint32_t send_time_us, struct rc_msg_v2 *msg_v2);
+bool unpack_rc_msg_v2(const struct rc_msg_v2 *msg_v2, struct rc_msg *msg, uint32_t *seq, uint32_t *send_time_us);
 void debug_sbus_data(int index, uint8_t *s);
 void debug_sbus_data_interval(int index, uint8_t *s, int interval);
 
@@ -35,6 +44,10 @@ int ppm_to_sbus(int ppm);
 int sbus_to_ppm(int sbus);
 
 bool check_crc(uint8_t buffer[]);
+uint16_t crc16_sum(uint8_t data[], size_t size);
 uint8_t bcc_sum(uint8_t data[], size_t size);
 
+int64_t monotonic_ns(void);
+void ns_to_timespec(int64_t ns, struct timespec *ts);
+
 #endif
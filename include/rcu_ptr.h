@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RCU_PTR_H
+#define RCU_PTR_H
+
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* poll interval of a writer waiting for readers of the old version */
+#define RCU_GRACE_POLL_US 100
+
+/*
+ * Pointer to an immutable object that is replaced as a whole.
+ *
+ * Readers hold a ReadGuard for the duration of one use and never block:
+ * entering is two atomic increments, retried only when a publish flips
+ * the epoch at the same moment. publish() swaps in the new object, then
+ * waits until every reader that may still see the old one has left and
+ * frees it. Writers are serialized by an internal mutex, so publish()
+ * belongs on a background thread.
+ */
+template <typename T>
+class RcuPtr
+{
+public:
+    class ReadGuard
+    {
+    public:
+        ReadGuard(const RcuPtr &rcu)
+            : mRcu(rcu)
+        {
+            uint32_t epoch;
+
+            do {
+                epoch = mRcu.mEpoch.load();
+                mRcu.mReaders[epoch & 1].fetch_add(1);
+                if (mRcu.mEpoch.load() == epoch)
+                    break;
+                /* a publish flipped the epoch meanwhile, join the new one */
+                mRcu.mReaders[epoch & 1].fetch_sub(1);
+            } while (1);
+
+            mEpoch = epoch;
+            mPtr = mRcu.mPtr.load();
+        }
+
+        ~ReadGuard()
+        {
+            mRcu.mReaders[mEpoch & 1].fetch_sub(1, std::memory_order_release);
+        }
+
+        const T *get() const { return mPtr; }
+        const T *operator->() const { return mPtr; }
+        const T &operator*() const { return *mPtr; }
+
+    private:
+        ReadGuard(const ReadGuard &);
+        ReadGuard &operator=(const ReadGuard &);
+
+        const RcuPtr &mRcu;
+        uint32_t mEpoch;
+        const T *mPtr;
+    };
+
+    RcuPtr(T *value = NULL)
+        : mPtr(value)
+        , mEpoch(0)
+    {
+        mReaders[0] = 0;
+        mReaders[1] = 0;
+        pthread_mutex_init(&mLock, NULL);
+    }
+
+    ~RcuPtr()
+    {
+        delete mPtr.load();
+        pthread_mutex_destroy(&mLock);
+    }
+
+    /* takes ownership of value, frees the replaced object */
+    void publish(T *value)
+    {
+        T *old;
+        uint32_t epoch;
+
+        pthread_mutex_lock(&mLock);
+        old = mPtr.exchange(value);
+        /* readers entering from now on see the new object */
+        epoch = mEpoch.fetch_add(1);
+        while (mReaders[epoch & 1].load(std::memory_order_acquire))
+            usleep(RCU_GRACE_POLL_US);
+        pthread_mutex_unlock(&mLock);
+
+        delete old;
+    }
+
+private:
+    RcuPtr(const RcuPtr &);
+    RcuPtr &operator=(const RcuPtr &);
+
+    std::atomic<T *> mPtr;
+    mutable std::atomic<uint32_t> mEpoch;
+    mutable std::atomic<int> mReaders[2];
+    pthread_mutex_t mLock;
+};
+
+#endif
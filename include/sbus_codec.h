@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SBUS_CODEC_H
+#define SBUS_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SBUS_CHANNELS         16
+/* 16 channels of 11 bit, LSB first */
+#define SBUS_PAYLOAD_LEN      22
+
+/*
+ * Packing and unpacking of the sbus channel payload, the 22 bytes after
+ * the start byte of a frame. Values are masked to 11 bit.
+ *
+ * Unpacking uses NEON on aarch64 and SSE2 or AVX2 on x86. 32 bit ARM
+ * builds have no vector unpack and always use the scalar code: armv7
+ * NEON lacks the 16 byte table lookup the NEON version is built on.
+ */
+void sbus_pack(const uint16_t channels[SBUS_CHANNELS], uint8_t payload[SBUS_PAYLOAD_LEN]);
+void sbus_unpack(const uint8_t payload[SBUS_PAYLOAD_LEN], uint16_t channels[SBUS_CHANNELS]);
+
+/*
+ * Pick the fastest unpack the cpu runs, after checking it against the
+ * scalar code. Call once at startup, before any thread uses the codec;
+ * until then the scalar code is used.
+ */
+void sbus_codec_init(void);
+
+/* name of the unpack implementation in use */
+const char *sbus_codec_name(void);
+
+/* whole 25 byte frames for replay and benchmarks, only the payload is read or written */
+void sbus_pack_frames(const uint16_t (*channels)[SBUS_CHANNELS], uint8_t (*frames)[25], size_t count);
+void sbus_unpack_frames(const uint8_t (*frames)[25], uint16_t (*channels)[SBUS_CHANNELS], size_t count);
+
+struct sbus_codec_impl {
+    const char *name;
+    void (*unpack)(const uint8_t *payload, uint16_t *channels);
+};
+
+/* every unpack implementation the cpu runs, scalar first, for tests and benchmarks */
+size_t sbus_codec_impls(const struct sbus_codec_impl **impls);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SBUS_DECODER_H
+#define SBUS_DECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "service.h"
+
+/* holds a partial frame plus any read, power of two */
+#define SBUS_DECODER_RING_SIZE 64
+
+/*
+ * Streaming decoder of one sbus serial port.
+ *
+ * Bytes of any read size go in with push(), complete frames come out of
+ * next(), several per read if the port delivered them. A frame is a
+ * start byte, 22 payload bytes, a flag byte with the reserved high
+ * nibble clear and an end byte. At any other position the decoder drops
+ * one byte and tries the next, so every byte is looked at a bounded
+ * number of times and resync is linear in the input.
+ */
+class SbusDecoder
+{
+public:
+    SbusDecoder();
+
+    /* returns how many bytes were taken, call next() until false and push the rest */
+    size_t push(const uint8_t *data, size_t len);
+    bool next(uint8_t frame[SBUS_DATA_LEN]);
+    /* drop buffered bytes, e.g. after the port was reopened */
+    void reset();
+
+    uint64_t framesDecoded() const { return mFrames; }
+    uint64_t bytesDiscarded() const { return mDiscarded; }
+
+private:
+    uint8_t at(size_t pos) const { return mRing[(mHead + pos) & (SBUS_DECODER_RING_SIZE - 1)]; }
+    bool frameAtHead() const;
+
+    uint8_t mRing[SBUS_DECODER_RING_SIZE];
+    size_t mHead;
+    size_t mCount;
+    uint64_t mFrames;
+    uint64_t mDiscarded;
+};
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SBUS_OUTPUT_H
+#define SBUS_OUTPUT_H
+
+#include <atomic>
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+
+/*
+ * Periodic sbus output engine.
+ *
+ * One long-lived thread sleeps on an absolute CLOCK_MONOTONIC deadline
+ * (timerfd armed with TFD_TIMER_ABSTIME) and calls the output function
+ * once per period. The wakeup lateness of every tick is collected in a
+ * histogram, missed periods are counted as overruns.
+ *
+ * In MODE_ARRIVAL the output function also runs as soon as notify()
+ * reports a new frame, but never closer than the minimum gap to the
+ * previous write. Without new frames the last one is repeated once per
+ * period.
+ *
+ * In MODE_PLL a software phase locked loop estimates the period and
+ * phase of the frame arrivals reported by notify(). Once locked, every
+ * deadline is nudged by at most a fraction of the period so that a
+ * write lands just after an expected arrival, keeping regular spacing
+ * while writing fresher data.
+ */
+class SbusOutput
+{
+public:
+    typedef void (*OutputFunc)(void *arg);
+
+    enum OutputMode {
+        MODE_TIMER,
+        MODE_ARRIVAL,
+        MODE_PLL
+    };
+
+    /* priority > 0 runs the output thread as SCHED_FIFO with that priority */
+    SbusOutput(const char *name, long periodNs, int priority, OutputFunc func, void *arg);
+    ~SbusOutput();
+
+    /* must be called before start() */
+    void setMode(OutputMode mode, long minGapNs);
+    /* MODE_PLL: distance of the aligned write after the expected arrival */
+    void setPhaseOffset(long offsetNs);
+    int start();
+    void stop();
+    /* called by the frame producer after publishing a new frame */
+    void notify();
+
+private:
+    enum {
+        HIST_BUCKETS = 8
+    };
+
+    static void *threadLoop(void *arg);
+    bool createThread(bool realtime);
+    bool armTimer(int64_t deadline);
+    void handleTimer(int64_t now);
+    void handleArrival(int64_t now);
+    void writeFrame(int64_t base);
+    void updatePll(int64_t now);
+    int64_t alignDeadline(int64_t deadline, int64_t now);
+    void closeFds();
+    void recordTick(int64_t lateNs, uint64_t expirations);
+    void dumpStats();
+
+    static const int64_t sHistLimitsNs[HIST_BUCKETS - 1];
+
+    std::string mName;
+    long mPeriodNs;
+    int mPriority;
+    OutputFunc mFunc;
+    void *mArg;
+    OutputMode mMode;
+    long mMinGapNs;
+    long mPhaseOffsetNs;
+    /* latest frame arrival, written by the producer */
+    std::atomic<int64_t> mArrivalNs;
+
+    int mTimerFd;
+    int mEventFd;
+    int mEpollFd;
+    pthread_t mThread;
+    std::atomic<bool> mRunning;
+
+    /* only touched by the output thread */
+    int64_t mDeadline;
+    int64_t mLastWriteNs;
+    int64_t mLastStatsNs;
+    uint64_t mTicks;
+    uint64_t mArrivalWrites;
+    uint64_t mOverruns;
+    int64_t mMaxLateNs;
+    uint64_t mHistogram[HIST_BUCKETS];
+
+    /* arrival phase locked loop, only touched by the output thread */
+    int64_t mPllLastArrivalNs;
+    int64_t mPllNextNs;
+    double mPllPeriodNs;
+    int64_t mPllPhaseErrNs;
+    int64_t mAlignErrNs;
+    int mPllGoodCount;
+    bool mPllLocked;
+};
+
+#endif
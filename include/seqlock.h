@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string.h>
+
+#define CACHELINE_SIZE 64
+
+/*
+ * Latest-value cell for one writer thread and any number of readers.
+ *
+ * The writer never waits. A reader retries only while a write is in
+ * flight, which is a copy of a few words, and always returns a complete
+ * value. The payload is kept in atomic words so the concurrent copy is
+ * well defined. T must be trivially copyable.
+ */
+template <typename T>
+class Seqlock
+{
+public:
+    Seqlock()
+        : mSeq(0)
+    {
+        for (int i = 0; i < WORDS; i++)
+            mData[i].store(0, std::memory_order_relaxed);
+    }
+
+    void write(const T &value)
+    {
+        uint32_t buf[WORDS] = { 0 };
+        uint32_t seq = mSeq.load(std::memory_order_relaxed);
+
+        memcpy(buf, &value, sizeof(T));
+
+        /* odd sequence marks a write in progress */
+        mSeq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int i = 0; i < WORDS; i++)
+            mData[i].store(buf[i], std::memory_order_relaxed);
+        mSeq.store(seq + 2, std::memory_order_release);
+    }
+
+    /* returns the sequence of the copied value, 0 means never written */
+    uint32_t read(T *value) const
+    {
+        uint32_t buf[WORDS];
+        uint32_t seq1, seq2;
+
+        do {
+            seq1 = mSeq.load(std::memory_order_acquire);
+            if (seq1 & 1)
+                continue;
+            for (int i = 0; i < WORDS; i++)
+                buf[i] = mData[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            seq2 = mSeq.load(std::memory_order_relaxed);
+        } while ((seq1 & 1) || seq1 != seq2);
+
+        memcpy(value, buf, sizeof(T));
+
+        return seq1;
+    }
+
+    uint32_t sequence() const
+    {
+        return mSeq.load(std::memory_order_acquire);
+    }
+
+private:
+    enum {
+        WORDS = (sizeof(T) + sizeof(uint32_t) - 1) / sizeof(uint32_t)
+    };
+
+    std::atomic<uint32_t> mSeq;
+    std::atomic<uint32_t> mData[WORDS];
+};
+
+#endif
@@ -36,43 +36,74 @@
 
 #define PPM_MODE              0x10
 #define SBUS_MODE             0x20
-#define CHANNEL_IDEX          0x01
+#define RC_MSG_V2             0x40
+#define CHANNEL_IDEX          0x0f
+/* number of sbus ports addressable by CHANNEL_IDEX */
+#define SBUS_MAX_PORTS        (CHANNEL_IDEX + 1)
 #define SBUS_BAUD             100000
 #define SBUS_DATA_LEN         25
 #define SBUS_STARTBYTE        0x0f
 #define SBUS_ENDBYTE          0x00
 
 struct rc_msg {
-    /* typs is MSB, idex is LSB */
+    /* typs is bits 4-6, idex is bits 0-3 */
     uint8_t type_idex;
     /* sbus or ppm data */
     uint8_t rc_data[SBUS_DATA_LEN];
 };
 
+/*
+ * Version 2 rc datagram, marked by RC_MSG_V2 in type_idex.
+ * seq counts frames per sbus, send_time_us is the sender monotonic
+ * clock. Multi-byte fields are little endian and crc is crc16_sum()
+ * over all preceding bytes.
+ */
+struct rc_msg_v2 {
+    uint8_t type_idex;
+    uint8_t reserved[3];
+    uint32_t seq;
+    uint32_t send_time_us;
+    uint8_t rc_data[SBUS_DATA_LEN];
+    uint16_t crc;
+} __attribute__((packed));
+
 enum {
     INPUT_DEV = 0,
     DATA_DEV,
     TTY_DEV,
 } input_source;
 
-struct gnd_service_config {
+/* plain values of gnd_service_config.ini, filled by a config schema */
+struct gnd_service_settings {
     char config_dir[PATH_MAX];
     char key_filename[PATH_MAX];
     char js_filename[PATH_MAX];
     int input_src;
 
     char ip[20];
-    unsigned long port;
+    int port;
+    /* rc datagram version to send, 1 or 2 */
+    int msg_version;
+    /* MessageSender::SendMode */
+    int send_mode;
+    float max_send_frequency;
 
+    bool sbus1_send_by_app;
     int send_sbus_num;
 
-    /* supported key name to key code map. */
-    std::map<int, std::string> supported_keys;
     bool long_press_enabled;
 
     char sbus_ports[2][PATH_MAX];
 };
 
+/* highest key code accepted in [KeySet] */
+#define KEY_CODE_MAX 0x2ff
+
+struct gnd_service_config : gnd_service_settings {
+    /* supported key name to key code map. */
+    std::map<int, std::string> supported_keys;
+};
+
 int air_main(int argc, char *argv[]);
 int gnd_main(int argc, char *argv[]);
 
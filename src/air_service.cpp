@@ -15,24 +15,82 @@
  */
 
 #include "config_loader.h"
+#include "config_schema.h"
 #include "board_control.h"
 #include "service.h"
 #include "rc_utils.h"
-#include <signal.h>
+#include "sbus_output.h"
+#include "seqlock.h"
+#include "rcu_ptr.h"
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <time.h>
 #include <linux/serial.h>
 #include <linux/un.h>
 
+#define RC_RECV_BATCH 16
+#define RC_STATS_INTERVAL_NS (10 * 1000000000LL)
+/* a sequence jump beyond this is treated as a sender restart */
+#define RC_SEQ_WINDOW 256
+
 struct radio_msg {
     uint8_t rssi;
     uint8_t noise;
 };
 
-struct rc_info {
+struct sbus_frame {
+    uint8_t data[SBUS_DATA_LEN];
+};
+
+/*
+ * Per port state. The fields set up at start and only read afterwards
+ * take one cache line, the frame cell the udp receiver keeps writing
+ * takes its own, so the output tick reading the former doesn't share a
+ * line with the receiver's stores, and neither do the two ports.
+ */
+struct alignas(CACHELINE_SIZE) rc_info {
+    int idx;
     int tty_fd;
-    bool update_flag;
-    /* sbus or ppm data */
-    uint8_t rc_data[SBUS_DATA_LEN];
+    /* output scheduling of this port only, NULL without a tty */
+    SbusOutput *output;
+    /* latest sbus frame, written by the udp receiver only */
+    alignas(CACHELINE_SIZE) Seqlock<struct sbus_frame> frame;
+};
+
+union rc_datagram {
+    struct rc_msg v1;
+    struct rc_msg_v2 v2;
+};
+
+struct rc_recv_stats {
+    uint64_t frames;
+    uint64_t coalesced;
+    uint64_t syscalls;
+    uint64_t invalid;
+};
+
+/*
+ * Per sbus statistics of v2 datagrams. The two monotonic clocks are not
+ * synchronized, so frame age is the transit time above the fastest
+ * frame seen in the previous stats interval.
+ */
+struct rc_link_stats {
+    bool synced;
+    uint32_t last_seq;
+    uint64_t received;
+    uint64_t lost;
+    uint64_t stale;
+    uint32_t base_offset;
+    uint32_t min_offset;
+    uint64_t age_sum;
+    uint32_t age_max;
+    uint32_t age_count;
+};
+
+struct sbus_port_config {
+    char port[20];
+    bool passthrough;
 };
 
 struct service_config {
@@ -43,85 +101,94 @@ struct service_config {
     int rssi_hys_min;
     int rssi_hys_max;
     /* sbus_config */
-    bool is_low_speed;
+    int is_low_speed;
     int sbus_count;
-    char sbus_port[2][20];
-    bool sbus_passthrough[2];
+    struct sbus_port_config sbus[SBUS_MAX_PORTS];
+    int output_priority;
+    SbusOutput::OutputMode output_mode;
+    int output_min_gap_us;
+    int output_pll_offset_us;
     /* other_config */
     int rc_inet_udp_port;
     char radio_unix_udp_name[20];
     int control_sbus;
 };
 
-static timer_t g_timer;
-static bool g_stop_flag = false;
-static struct rc_info g_rc[2];
+static std::atomic<bool> g_stop_flag(false);
+static struct rc_info g_rc[SBUS_MAX_PORTS];
+/* startup config, ports and output settings only change with a restart */
 static struct service_config g_cfg;
-static pthread_mutex_t sbus_lock;
-static pthread_mutex_t bc_lock;
-static pthread_cond_t bc_cond;
+/* radio thresholds and board control routing, replaced on config change */
+static RcuPtr<struct service_config> g_live;
+static string g_cfg_file;
+static struct rc_recv_stats g_recv_stats;
+static struct rc_link_stats g_link[SBUS_MAX_PORTS];
+static int g_bc_event_fd = -1;
 
 static int sbus_init(void)
 {
     int i;
 
     for (i = 0; i < g_cfg.sbus_count; i++) {
-        g_rc[i].update_flag = false;
-        if (!strcmp(g_cfg.sbus_port[i], ""))
+        g_rc[i].idx = i;
+        if (!strcmp(g_cfg.sbus[i].port, ""))
             continue;
-        g_rc[i].tty_fd = sbus_port_init(g_cfg.sbus_port[i]);
+        g_rc[i].tty_fd = sbus_port_init(g_cfg.sbus[i].port);
         if (g_rc[i].tty_fd < 0) {
-            ALOGE("open %s failed to connect error=%s\n", g_cfg.sbus_port[i], strerror(errno));
+            ALOGE("open %s failed to connect error=%s\n", g_cfg.sbus[i].port, strerror(errno));
             return -ENXIO;
         }
 
-        ALOGI("%s sbus init success\n", g_cfg.sbus_port[i]);
+        ALOGI("%s sbus init success\n", g_cfg.sbus[i].port);
     }
 
     return 0;
 }
 
-static void output_sbus_singal(union sigval)
+static void output_sbus_singal(void *arg)
 {
-    static uint8_t sbusdata[2][SBUS_DATA_LEN];
-    int i;
+    struct rc_info *rc = (struct rc_info *)arg;
+    struct sbus_frame sbusdata;
 
-    for (i = 0; i < 2; i++) {
-        if (g_rc[i].update_flag) {
-            pthread_mutex_lock(&sbus_lock);
-            memcpy(sbusdata[i], g_rc[i].rc_data, sizeof(sbusdata[0]));
-            pthread_mutex_unlock(&sbus_lock);
-            g_rc[i].update_flag = false;
-        }
-    }
+    /* always the most recent complete frame, never waits for the receiver */
+    rc->frame.read(&sbusdata);
 
-    if (!g_stop_flag) {
-        if (g_rc[0].tty_fd && (write(g_rc[0].tty_fd, sbusdata[0], sizeof(sbusdata[0])) < 0))
-            ALOGE("send sbus0 singal failed, err:%s\n", strerror(errno));
-        if (g_rc[1].tty_fd && (write(g_rc[1].tty_fd, sbusdata[1], sizeof(sbusdata[1])) < 0))
-            ALOGE("send sbus1 singal failed, err:%s\n", strerror(errno));
-    }
+    if (!g_stop_flag && (write(rc->tty_fd, sbusdata.data, sizeof(sbusdata.data)) < 0))
+        ALOGE("send sbus%d singal failed, err:%s\n", rc->idx, strerror(errno));
 }
 
-static void timer_init(void)
+static int output_init(void)
 {
-    struct sigevent evp;
-    struct itimerspec ts;
+    long period = (g_cfg.is_low_speed) ? (1000000000 / 70) : (1000000000 / 140);
+    char name[32];
+    int i, res;
 
-    memset(&evp, 0, sizeof(struct sigevent));
-    memset(&ts, 0, sizeof(struct itimerspec));
+    /* one output thread per port, so a slow tty doesn't delay the others */
+    for (i = 0; i < g_cfg.sbus_count; i++) {
+        if (!g_rc[i].tty_fd)
+            continue;
+
+        snprintf(name, sizeof(name), "sbus%d output", i + 1);
+        g_rc[i].output = new SbusOutput(name, period, g_cfg.output_priority, output_sbus_singal, &g_rc[i]);
+        g_rc[i].output->setMode(g_cfg.output_mode, g_cfg.output_min_gap_us * 1000L);
+        g_rc[i].output->setPhaseOffset(g_cfg.output_pll_offset_us * 1000L);
 
-    evp.sigev_value.sival_ptr = &g_timer;
-    evp.sigev_notify = SIGEV_THREAD;
-    evp.sigev_notify_function = output_sbus_singal;
-    timer_create(CLOCK_MONOTONIC, &evp, &g_timer);
+        res = g_rc[i].output->start();
+        if (res < 0)
+            return res;
+    }
 
-    ts.it_interval.tv_sec = 0;
-    ts.it_interval.tv_nsec = (g_cfg.is_low_speed) ? (1000000000 / 70) : (1000000000 / 140);
-    ts.it_value.tv_sec = 1;
-    ts.it_value.tv_nsec = 0;
+    return 0;
+}
 
-    timer_settime(g_timer, 0, &ts, NULL);
+static void output_deinit(void)
+{
+    for (int i = 0; i < g_cfg.sbus_count; i++) {
+        if (g_rc[i].output) {
+            delete g_rc[i].output;
+            g_rc[i].output = NULL;
+        }
+    }
 }
 
 static void process_radio_msg(struct radio_msg *radio_status)
@@ -129,6 +196,7 @@ static void process_radio_msg(struct radio_msg *radio_status)
     static int rssi = INT_MAX, snr = INT_MAX;
     static int log_interval;
     int tmp_rssi, tmp_noise, tmp_snr;
+    RcuPtr<struct service_config>::ReadGuard cfg(g_live);
 
     if (!radio_status) {
         ALOGE("%s invalid param", __FUNCTION__);
@@ -141,8 +209,8 @@ static void process_radio_msg(struct radio_msg *radio_status)
 
     /* using one order lag filtering algorithm for rssi and snr */
     if (rssi != INT_MAX) {
-        rssi = (int)(rssi * (1.0 - g_cfg.filter) + tmp_rssi * g_cfg.filter);
-        snr = (int)(snr * (1.0 - g_cfg.filter) + tmp_snr * g_cfg.filter);
+        rssi = (int)(rssi * (1.0 - cfg->filter) + tmp_rssi * cfg->filter);
+        snr = (int)(snr * (1.0 - cfg->filter) + tmp_snr * cfg->filter);
     } else {
         /* first */
         rssi = tmp_rssi;
@@ -150,19 +218,17 @@ static void process_radio_msg(struct radio_msg *radio_status)
     }
 
     /* using hysteresis comparator for rssi and snr */
-    if ((snr < g_cfg.snr_hys_min) || (rssi < g_cfg.rssi_hys_min)) {
+    if ((snr < cfg->snr_hys_min) || (rssi < cfg->rssi_hys_min)) {
         g_stop_flag =  true;
-    } else if ((snr > g_cfg.snr_hys_max) && (rssi > g_cfg.rssi_hys_max)) {
+    } else if ((snr > cfg->snr_hys_max) && (rssi > cfg->rssi_hys_max)) {
         g_stop_flag = false;
     }
-    g_rc[0].update_flag = true;
-    g_rc[1].update_flag = true;
 
     if (log_interval % 20 == 0) {
-        ALOGI("radio status r:%d, cr:%d, s:%d, cs:%d, fs:%d, fu:%d,%d\n",
-              tmp_rssi, rssi, tmp_snr, snr, (int)g_stop_flag, (int)g_rc[0].update_flag, (int)g_rc[1].update_flag);
+        ALOGI("radio status r:%d, cr:%d, s:%d, cs:%d, fs:%d\n",
+              tmp_rssi, rssi, tmp_snr, snr, (int)g_stop_flag);
         ALOGI("radio threshold filter:%.2f, snr_hmin:%d, snr_hmax:%d, rssi_hmin:%d, rssi_hmax:%d\n",
-              g_cfg.filter, g_cfg.snr_hys_min, g_cfg.snr_hys_max, g_cfg.rssi_hys_min, g_cfg.rssi_hys_max);
+              cfg->filter, cfg->snr_hys_min, cfg->snr_hys_max, cfg->rssi_hys_min, cfg->rssi_hys_max);
         log_interval = 0;
     }
     log_interval++;
@@ -206,20 +272,48 @@ static int socket_init(uint16_t family, int port, char *name)
 
 static void *handle_control(void *data)
 {
-    string filename = (char *)data;
-    uint8_t sbusdata[25] = "\0";
-    BoardControl * bc = new BoardControl(filename);
+    BoardControl *bc = (BoardControl *)data;
+    struct sbus_frame sbusdata;
+    uint64_t count, updates = 0;
+    int idx;
+    int64_t wake, latency, latency_sum = 0, latency_max = 0, last_log = 0;
 
     while (1) {
-        pthread_mutex_lock(&bc_lock);
-        pthread_cond_wait(&bc_cond, &bc_lock);
-        pthread_mutex_unlock(&bc_lock);
+        /* any number of frames published since the last wakeup is one update */
+        if (read(g_bc_event_fd, &count, sizeof(count)) != sizeof(count)) {
+            if (errno != EINTR)
+                ALOGE("board control wait failed, err:%s\n", strerror(errno));
+            continue;
+        }
+        wake = monotonic_ns();
 
-        pthread_mutex_lock(&sbus_lock);
-        memcpy(sbusdata, g_rc[bc->mControlSbus].rc_data, sizeof(sbusdata));
-        pthread_mutex_unlock(&sbus_lock);
+        {
+            RcuPtr<struct service_config>::ReadGuard cfg(g_live);
 
-        bc->controlDev(&sbusdata);
+            /* a reload may have turned control off since the notify */
+            idx = cfg->control_sbus;
+            if (idx < 0 || cfg->sbus[idx].passthrough)
+                continue;
+        }
+        g_rc[idx].frame.read(&sbusdata);
+
+        bc->controlDev(&sbusdata.data);
+
+        latency = monotonic_ns() - wake;
+        latency_sum += latency;
+        if (latency > latency_max)
+            latency_max = latency;
+        updates++;
+
+        if (wake - last_log >= RC_STATS_INTERVAL_NS) {
+            ALOGI("board control updates:%llu, wake to pwm write avg:%lldus, max:%lldus\n",
+                  (unsigned long long)updates, (long long)(latency_sum / updates / 1000),
+                  (long long)(latency_max / 1000));
+            updates = 0;
+            latency_sum = 0;
+            latency_max = 0;
+            last_log = wake;
+        }
     }
 }
 
@@ -251,9 +345,227 @@ fail:
     exit(-1);
 }
 
-static int load_config_file(const string &filename)
+static void publish_sbus_frame(int idx, const struct rc_msg *msg)
+{
+    struct sbus_frame frame;
+    RcuPtr<struct service_config>::ReadGuard cfg(g_live);
+
+    memcpy(frame.data, msg->rc_data, SBUS_DATA_LEN);
+    g_rc[idx].frame.write(frame);
+    debug_sbus_data_interval(idx, frame.data + 1, 70);
+    if (!cfg->sbus[idx].passthrough && idx == cfg->control_sbus && g_bc_event_fd >= 0) {
+        uint64_t one = 1;
+        if (write(g_bc_event_fd, &one, sizeof(one)) < 0)
+            ALOGE("notify board control failed, err:%s\n", strerror(errno));
+    }
+}
+
+/*
+ * Account a v2 frame on its sbus link, returns false for a frame older
+ * than one already accepted.
+ */
+static bool check_rc_link(int idx, uint32_t seq, uint32_t send_time_us, uint32_t recv_time_us)
+{
+    struct rc_link_stats *link = &g_link[idx];
+    int32_t diff = (int32_t)(seq - link->last_seq);
+    uint32_t offset = recv_time_us - send_time_us;
+    int32_t age;
+
+    if (link->synced && diff <= 0 && diff > -RC_SEQ_WINDOW) {
+        link->stale++;
+        return false;
+    }
+
+    if (!link->synced || diff <= 0 || diff > RC_SEQ_WINDOW) {
+        /* first frame or sender restarted, count from here */
+        link->synced = true;
+        link->base_offset = offset;
+        link->min_offset = offset;
+    } else {
+        link->lost += diff - 1;
+    }
+    link->last_seq = seq;
+    link->received++;
+
+    age = (int32_t)(offset - link->base_offset);
+    if (age < 0) {
+        link->base_offset = offset;
+        age = 0;
+    }
+    if ((int32_t)(offset - link->min_offset) < 0)
+        link->min_offset = offset;
+
+    link->age_sum += age;
+    link->age_count++;
+    if ((uint32_t)age > link->age_max)
+        link->age_max = age;
+
+    return true;
+}
+
+static void dump_rc_link_stats(void)
+{
+    struct rc_link_stats *link;
+
+    for (int idx = 0; idx < g_cfg.sbus_count; idx++) {
+        link = &g_link[idx];
+        if (!link->synced)
+            continue;
+
+        ALOGI("sbus%d link rx:%llu, lost:%llu, stale:%llu, age avg:%uus, max:%uus\n", idx,
+              (unsigned long long)link->received, (unsigned long long)link->lost,
+              (unsigned long long)link->stale,
+              link->age_count ? (unsigned)(link->age_sum / link->age_count) : 0, link->age_max);
+
+        /* follow clock drift between both units */
+        link->base_offset = link->min_offset;
+        link->age_sum = 0;
+        link->age_count = 0;
+        link->age_max = 0;
+    }
+}
+
+/*
+ * Validate a received datagram of either version and convert it to a
+ * v1 message. v1 has no sequence, so it is always taken as newest.
+ */
+static bool parse_rc_datagram(const union rc_datagram *dgram, unsigned int len, uint32_t recv_time_us, struct rc_msg *msg)
+{
+    uint32_t seq = 0, send_time_us = 0;
+    bool v2 = false;
+
+    if (len == sizeof(struct rc_msg) && !(dgram->v1.type_idex & RC_MSG_V2)) {
+        *msg = dgram->v1;
+    } else if (len == sizeof(struct rc_msg_v2) && unpack_rc_msg_v2(&dgram->v2, msg, &seq, &send_time_us)) {
+        v2 = true;
+    } else {
+        g_recv_stats.invalid++;
+        return false;
+    }
+
+    /* the channel index selects an sbus port only in sbus mode */
+    if (!(msg->type_idex & SBUS_MODE))
+        return false;
+    if ((msg->type_idex & CHANNEL_IDEX) >= g_cfg.sbus_count) {
+        g_recv_stats.invalid++;
+        return false;
+    }
+
+    return !v2 || check_rc_link(msg->type_idex & CHANNEL_IDEX, seq, send_time_us, recv_time_us);
+}
+
+/*
+ * Drain every queued rc datagram and publish only the newest frame of
+ * each sbus, so a burst delivered after a link fade is not replayed
+ * frame by frame.
+ */
+static void recv_rc_msgs(int sfd)
+{
+    static union rc_datagram dgrams[RC_RECV_BATCH];
+    static struct mmsghdr hdrs[RC_RECV_BATCH];
+    static struct iovec iovs[RC_RECV_BATCH];
+    static int64_t last_log;
+    struct rc_msg msg, latest[SBUS_MAX_PORTS];
+    bool pending[SBUS_MAX_PORTS] = { false };
+    int flags = MSG_WAITFORONE;
+    int i, n, idx;
+    int64_t now;
+
+    for (i = 0; i < RC_RECV_BATCH; i++) {
+        iovs[i].iov_base = &dgrams[i];
+        iovs[i].iov_len = sizeof(union rc_datagram);
+        memset(&hdrs[i], 0, sizeof(hdrs[i]));
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        n = recvmmsg(sfd, hdrs, RC_RECV_BATCH, flags, NULL);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN)
+                ALOGE("receive rc message failed, err:%s\n", strerror(errno));
+            break;
+        }
+        g_recv_stats.syscalls++;
+        now = monotonic_ns();
+
+        for (i = 0; i < n; i++) {
+            if (!parse_rc_datagram(&dgrams[i], hdrs[i].msg_len, (uint32_t)(now / 1000), &msg))
+                continue;
+            idx = msg.type_idex & CHANNEL_IDEX;
+            if (pending[idx])
+                g_recv_stats.coalesced++;
+            latest[idx] = msg;
+            pending[idx] = true;
+            g_recv_stats.frames++;
+        }
+
+        /* a full batch means more may be queued, keep draining without blocking */
+        flags = MSG_DONTWAIT;
+    } while (n == RC_RECV_BATCH);
+
+    for (idx = 0; idx < g_cfg.sbus_count; idx++) {
+        if (!pending[idx])
+            continue;
+        publish_sbus_frame(idx, &latest[idx]);
+        if (g_rc[idx].output)
+            g_rc[idx].output->notify();
+    }
+
+    now = monotonic_ns();
+    if (now - last_log >= RC_STATS_INTERVAL_NS) {
+        ALOGI("rc recv frames:%llu, coalesced:%llu, invalid:%llu, syscalls:%llu\n",
+              (unsigned long long)g_recv_stats.frames, (unsigned long long)g_recv_stats.coalesced,
+              (unsigned long long)g_recv_stats.invalid, (unsigned long long)g_recv_stats.syscalls);
+        dump_rc_link_stats();
+        last_log = now;
+    }
+}
+
+static const ConfigEnum_t speed_enums[] = {
+    { "low", 1 },
+    { "high", 0 },
+    { NULL, 0 },
+};
+
+static const ConfigEnum_t output_mode_enums[] = {
+    { "timer", SbusOutput::MODE_TIMER },
+    { "arrival", SbusOutput::MODE_ARRIVAL },
+    { "pll", SbusOutput::MODE_PLL },
+    { NULL, 0 },
+};
+
+static const ConfigField_t service_config_fields[] = {
+    CONFIG_FIELD_FLOAT("Radio_config", "filter", struct service_config, filter, 0.25, 0, 1),
+    CONFIG_FIELD_INT("Radio_config", "snr.hys.min", struct service_config, snr_hys_min, -10, -200, 200),
+    CONFIG_FIELD_INT("Radio_config", "snr.hys.max", struct service_config, snr_hys_max, -5, -200, 200),
+    CONFIG_FIELD_INT("Radio_config", "rssi.hys.min", struct service_config, rssi_hys_min, -130, -200, 0),
+    CONFIG_FIELD_INT("Radio_config", "rssi.hys.max", struct service_config, rssi_hys_max, -125, -200, 0),
+
+    CONFIG_FIELD_ENUM("SBUS_config", "is_low_speed", struct service_config, is_low_speed, "low", speed_enums),
+    CONFIG_FIELD_INT("SBUS_config", "sbus_count", struct service_config, sbus_count, 2, 1, SBUS_MAX_PORTS),
+    CONFIG_FIELD_INT("SBUS_config", "output_priority", struct service_config, output_priority, 0, 0, 99),
+    CONFIG_FIELD_ENUM("SBUS_config", "output_mode", struct service_config, output_mode, "timer", output_mode_enums),
+    CONFIG_FIELD_INT("SBUS_config", "output_min_gap_us", struct service_config, output_min_gap_us, 7000, 0, 1000000),
+    CONFIG_FIELD_INT("SBUS_config", "output_pll_offset_us", struct service_config, output_pll_offset_us, 1000, 0, 1000000),
+
+    CONFIG_FIELD_INT("Other_config", "rc_inet_udp_port", struct service_config, rc_inet_udp_port, 16666, 1, 65535),
+    CONFIG_FIELD_STR("Other_config", "radio_unix_udp_name", struct service_config, radio_unix_udp_name, ""),
+    /* from 1 in the file, 0 disables board control */
+    CONFIG_FIELD_INT("Other_config", "board_control_sbus", struct service_config, control_sbus, 0, 0, SBUS_MAX_PORTS),
+};
+
+static const ConfigField_t sbus_port_fields[] = {
+    CONFIG_FIELD_STR("SBUS_config", "sbus%d_port", struct sbus_port_config, port, ""),
+    { "SBUS_config", "sbus%d_passthrough", CONFIG_BOOL, CONFIG_MEMBER(struct sbus_port_config, passthrough),
+      0, 0, 1, NULL, NULL, CONFIG_KEEP },
+};
+
+static int load_config_file(const string &filename, struct service_config *out)
 {
     ConfigLoader config_loader;
+    ConfigSchema schema(&config_loader, filename);
+    struct service_config cfg;
 
     if (filename.empty())
         return -EINVAL;
@@ -263,59 +575,187 @@ static int load_config_file(const string &filename)
         return -ENXIO;
     }
 
-    config_loader.beginSection("Radio_config");
-    g_cfg.filter = config_loader.getFloat("filter", 0.25);
-    g_cfg.snr_hys_min = config_loader.getInt("snr.hys.min", -10);
-    g_cfg.snr_hys_max = config_loader.getInt("snr.hys.max", -5);
-    g_cfg.rssi_hys_min = config_loader.getInt("rssi.hys.min", -130);
-    g_cfg.rssi_hys_max = config_loader.getInt("rssi.hys.max", -125);
-    config_loader.endSection();
-
-    config_loader.beginSection("SBUS_config");
-    g_cfg.is_low_speed = !strcmp(config_loader.getStr("is_low_speed", "low").c_str(), "low");
-    g_cfg.sbus_count = config_loader.getInt("sbus_count", 2);
-    strcpy(g_cfg.sbus_port[0], config_loader.getStr("sbus1_port", "").c_str());
-    strcpy(g_cfg.sbus_port[1], config_loader.getStr("sbus2_port", "").c_str());
-    g_cfg.sbus_passthrough[0] = config_loader.getBool("sbus1_passthrough", true);
-    g_cfg.sbus_passthrough[1] = config_loader.getBool("sbus2_passthrough", false);
-    config_loader.endSection();
-
-    config_loader.beginSection("Other_config");
-    g_cfg.rc_inet_udp_port = config_loader.getInt("rc_inet_udp_port", 16666);
-    strcpy(g_cfg.radio_unix_udp_name, config_loader.getStr("radio_unix_udp_name", "").c_str());
-    g_cfg.control_sbus = config_loader.getInt("board_control_sbus", 0) - 1;
-    config_loader.endSection();
-
-    ALOGI("config info -> filter:%.2f, snr_hmin:%d, snr_hmax:%d, rssi_hmin:%d, rssi_hmax:%d, is_low_speed:%d, sbus1_port:%s, sbus2_port:%s, rc_inet_udp_port:%d, radio_unix_udp_name:%s\n",
-          g_cfg.filter, g_cfg.snr_hys_min, g_cfg.snr_hys_max, g_cfg.rssi_hys_min, g_cfg.rssi_hys_max,
-          g_cfg.is_low_speed, g_cfg.sbus_port[0], g_cfg.sbus_port[1], g_cfg.rc_inet_udp_port, g_cfg.radio_unix_udp_name);
+    memset(&cfg, 0, sizeof(cfg));
+    schema.bind(service_config_fields, sizeof(service_config_fields) / sizeof(service_config_fields[0]), &cfg);
+    for (int i = 0; i < cfg.sbus_count; i++) {
+        /* only sbus1 defaults to passthrough, as it always did */
+        cfg.sbus[i].passthrough = (i == 0);
+        schema.bind(sbus_port_fields, sizeof(sbus_port_fields) / sizeof(sbus_port_fields[0]), &cfg.sbus[i], NULL, i + 1);
+    }
+
+    if (cfg.snr_hys_min > cfg.snr_hys_max)
+        schema.error("[Radio_config] snr.hys.min %d above snr.hys.max %d", cfg.snr_hys_min, cfg.snr_hys_max);
+    if (cfg.rssi_hys_min > cfg.rssi_hys_max)
+        schema.error("[Radio_config] rssi.hys.min %d above rssi.hys.max %d", cfg.rssi_hys_min, cfg.rssi_hys_max);
+    if (cfg.control_sbus > cfg.sbus_count)
+        schema.error("[Other_config] board_control_sbus %d above sbus_count %d", cfg.control_sbus, cfg.sbus_count);
+
+    if (!schema.report())
+        return -EINVAL;
+
+    cfg.control_sbus -= 1;
+    *out = cfg;
+
+    ALOGI("config info -> filter:%.2f, snr_hmin:%d, snr_hmax:%d, rssi_hmin:%d, rssi_hmax:%d, is_low_speed:%d, sbus_count:%d, rc_inet_udp_port:%d, radio_unix_udp_name:%s\n",
+          cfg.filter, cfg.snr_hys_min, cfg.snr_hys_max, cfg.rssi_hys_min, cfg.rssi_hys_max,
+          cfg.is_low_speed, cfg.sbus_count, cfg.rc_inet_udp_port, cfg.radio_unix_udp_name);
+    for (int i = 0; i < cfg.sbus_count; i++)
+        ALOGI("config info -> sbus%d_port:%s, passthrough:%d\n", i + 1, cfg.sbus[i].port, cfg.sbus[i].passthrough);
 
     return 0;
 }
 
+/* true if cfg differs from the startup config in a field that needs a restart */
+static bool restart_config_changed(const struct service_config *cfg)
+{
+    if (cfg->is_low_speed != g_cfg.is_low_speed || cfg->sbus_count != g_cfg.sbus_count ||
+        cfg->output_priority != g_cfg.output_priority || cfg->output_mode != g_cfg.output_mode ||
+        cfg->output_min_gap_us != g_cfg.output_min_gap_us ||
+        cfg->output_pll_offset_us != g_cfg.output_pll_offset_us ||
+        cfg->rc_inet_udp_port != g_cfg.rc_inet_udp_port ||
+        strcmp(cfg->radio_unix_udp_name, g_cfg.radio_unix_udp_name))
+        return true;
+
+    for (int i = 0; i < g_cfg.sbus_count; i++) {
+        if (strcmp(cfg->sbus[i].port, g_cfg.sbus[i].port))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Parse the changed config file and publish the runtime part of it.
+ * Any error keeps the running config, the output timers never stop.
+ */
+static void reload_config(BoardControl *bc)
+{
+    struct service_config cfg, *live;
+    bool control;
+
+    ALOGI("config file %s changed, reloading\n", g_cfg_file.c_str());
+
+    if (load_config_file(g_cfg_file, &cfg) < 0) {
+        ALOGE("reload config failed, keep the running config\n");
+        return;
+    }
+
+    if (restart_config_changed(&cfg))
+        ALOGW("sbus ports, output and socket settings only take effect after a restart\n");
+
+    if (cfg.control_sbus >= g_cfg.sbus_count) {
+        ALOGE("board_control_sbus %d above running sbus_count %d, keep the running config\n",
+              cfg.control_sbus + 1, g_cfg.sbus_count);
+        return;
+    }
+
+    /* the static fields of the startup config stay, take the runtime ones */
+    live = new struct service_config(g_cfg);
+    live->filter = cfg.filter;
+    live->snr_hys_min = cfg.snr_hys_min;
+    live->snr_hys_max = cfg.snr_hys_max;
+    live->rssi_hys_min = cfg.rssi_hys_min;
+    live->rssi_hys_max = cfg.rssi_hys_max;
+    live->control_sbus = cfg.control_sbus;
+    for (int i = 0; i < g_cfg.sbus_count && i < cfg.sbus_count; i++)
+        live->sbus[i].passthrough = cfg.sbus[i].passthrough;
+
+    control = live->control_sbus >= 0 && !live->sbus[live->control_sbus].passthrough;
+    if (!bc->reloadSettings() && control) {
+        ALOGE("invalid board control config, keep the running config\n");
+        delete live;
+        return;
+    }
+
+    g_live.publish(live);
+    ALOGI("config reloaded, board control sbus:%d\n", control ? cfg.control_sbus + 1 : 0);
+}
+
+static void *watch_config(void *data)
+{
+    BoardControl *bc = (BoardControl *)data;
+    char event_buf[512] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ievent;
+    string dir, base;
+    size_t slash;
+    int fd, res, pos;
+    bool changed;
+
+    slash = g_cfg_file.rfind('/');
+    if (slash == string::npos) {
+        dir = ".";
+        base = g_cfg_file;
+    } else {
+        dir = slash ? g_cfg_file.substr(0, slash) : "/";
+        base = g_cfg_file.substr(slash + 1);
+    }
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        ALOGE("config watch init failed, err:%s\n", strerror(errno));
+        return NULL;
+    }
+
+    /* watch the directory, editors replace the file by rename */
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        ALOGE("config watch %s failed, err:%s\n", dir.c_str(), strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    while (1) {
+        res = read(fd, event_buf, sizeof(event_buf));
+        if (res < (int)sizeof(*ievent)) {
+            if (res < 0 && errno != EINTR)
+                ALOGE("config watch read failed, err:%s\n", strerror(errno));
+            continue;
+        }
+
+        /* a burst of events for the file is one reload */
+        changed = false;
+        for (pos = 0; pos + (int)sizeof(*ievent) <= res; pos += sizeof(*ievent) + ievent->len) {
+            ievent = (struct inotify_event *)(event_buf + pos);
+            if (ievent->len && base == ievent->name)
+                changed = true;
+        }
+
+        if (changed)
+            reload_config(bc);
+    }
+}
+
 int air_main(int argc, char *argv[])
 {
-    pthread_t radio_thread, board_control_thread;
-    struct sockaddr_in fromaddr;
-    struct rc_msg msg;
-    int sfd = 0, idx, res;
-    socklen_t len = sizeof(struct sockaddr_in);
-    ssize_t size = sizeof(struct rc_msg);
+    pthread_t radio_thread, board_control_thread, watch_thread;
+    BoardControl *bc = NULL;
+    int sfd = 0, res;
 
     if (!argc)
         return -EINVAL;
 
-    res = load_config_file(argv[0]);
+    g_cfg_file = argv[0];
+    res = load_config_file(g_cfg_file, &g_cfg);
     if (res < 0)
         return res;
+    g_live.publish(new struct service_config(g_cfg));
+
+    /* always there, a reload may turn board control on later */
+    bc = new BoardControl(g_cfg_file);
+    if (g_cfg.control_sbus >= 0 && !g_cfg.sbus[g_cfg.control_sbus].passthrough && !bc->isValid()) {
+        ALOGE("invalid board control config\n");
+        delete bc;
+        return -EINVAL;
+    }
 
     res = sbus_init();
     if (res < 0)
-        return res;
-
-    pthread_mutex_init(&sbus_lock, NULL);
+        goto radio_thread_fail;
 
-    timer_init();
+    res = output_init();
+    if (res < 0) {
+        ALOGE("start sbus output failed\n");
+        goto radio_thread_fail;
+    }
 
     res = pthread_create(&radio_thread, NULL, recv_radio_msg, NULL);
     if (res < 0) {
@@ -323,16 +763,22 @@ int air_main(int argc, char *argv[])
         goto radio_thread_fail;
     }
 
-    if ((!g_cfg.sbus_passthrough[0] || !g_cfg.sbus_passthrough[1]) && (g_cfg.control_sbus > 0)) {
-        pthread_mutex_init(&bc_lock, NULL);
-        pthread_cond_init(&bc_cond, NULL);
-        res = pthread_create(&board_control_thread, NULL, handle_control, argv[0]);
-        if (res < 0) {
-            ALOGE("create board control thread failed\n");
-            goto board_control_thread_fail;
-        }
+    g_bc_event_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_bc_event_fd < 0) {
+        ALOGE("create board control eventfd failed\n");
+        goto board_control_thread_fail;
+    }
+    res = pthread_create(&board_control_thread, NULL, handle_control, bc);
+    if (res < 0) {
+        ALOGE("create board control thread failed\n");
+        goto board_control_thread_fail;
     }
 
+    /* without a watcher the service just keeps its startup config */
+    res = pthread_create(&watch_thread, NULL, watch_config, bc);
+    if (res < 0)
+        ALOGE("create config watch thread failed\n");
+
     sfd = socket_init(AF_INET, g_cfg.rc_inet_udp_port, NULL);
     if (sfd < 0) {
         ALOGE("create rc inet sock_dgram failed\n");
@@ -340,39 +786,28 @@ int air_main(int argc, char *argv[])
     }
 
     while (1) {
-        if (recvfrom(sfd, &msg, size, 0, (struct sockaddr *)&fromaddr, &len) == size) {
-             if (msg.type_idex & SBUS_MODE) {
-                 idx = msg.type_idex & CHANNEL_IDEX;
-                 pthread_mutex_lock(&sbus_lock);
-                 memcpy(g_rc[idx].rc_data, msg.rc_data, SBUS_DATA_LEN);
-                 pthread_mutex_unlock(&sbus_lock);
-                 g_rc[idx].update_flag = true;
-                 debug_sbus_data_interval(idx, g_rc[idx].rc_data + 1, 70);
-                 if (!g_cfg.sbus_passthrough[idx]) {
-                     pthread_mutex_lock(&bc_lock);
-                     pthread_cond_signal(&bc_cond);
-                     pthread_mutex_unlock(&bc_lock);
-                 }
-             }
-        }
-        memset(&msg, '0', size);
+        recv_rc_msgs(sfd);
     }
 
     return 0;
 
 socket_fail:
-    if (!g_cfg.sbus_passthrough[0] || !g_cfg.sbus_passthrough[1])
+    if (g_bc_event_fd >= 0)
         pthread_exit(&board_control_thread);
 board_control_thread_fail:
     pthread_exit(&radio_thread);
 radio_thread_fail:
-    if (g_rc[0].tty_fd)
-        close(g_rc[0].tty_fd);
+    output_deinit();
 
-    if (g_rc[1].tty_fd)
-        close(g_rc[1].tty_fd);
+    delete bc;
+
+    for (int i = 0; i < g_cfg.sbus_count; i++) {
+        if (g_rc[i].tty_fd)
+            close(g_rc[i].tty_fd);
+    }
 
-    timer_delete(g_timer);
+    if (g_bc_event_fd >= 0)
+        close(g_bc_event_fd);
 
     if (sfd)
         close(sfd);
@@ -16,79 +16,181 @@
 
 #include "board_control.h"
 #include "rc_utils.h"
+#include "sbus_codec.h"
 #include "service.h"
-#include <sstream>
 
-#define PWM_PATH(port, str_1, str_2, node) \
-    port ? (str_1 = str_2 + "1/" + node) : (str_1 = str_2 + "0/" + node);
+#define PWM_ATTR_PATH "/sys/class/pwm/pwmchip0/pwm%d/%s"
 
-string PWM_BASE_PATH = "/sys/class/pwm/pwmchip0/pwm";
 string PWM_EXPORT_PATH = "/sys/class/pwm/pwmchip0/export";
 
+const ConfigField_t BoardControl::sPwmFields[] = {
+    CONFIG_FIELD_INT("Device_pwm_%d", "pwm_period", PwmSettings_t, period, 0, 0, 1000000000),
+    CONFIG_FIELD_INT("Device_pwm_%d", "sbus_channel", PwmSettings_t, channel, 0, 0, 16),
+};
+
+static int open_pwm_attr(int port, const char *node)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), PWM_ATTR_PATH, port, node);
+
+    return sysfs_attr_open(path);
+}
+
 BoardControl::BoardControl(const string &filename)
-    :mFileName(filename)
+    : mFileName(filename)
+    , mGeneration(0)
+    , mAppliedGeneration(0)
+    , mValid(false)
 {
     mLoader = new ConfigLoader();
     /* Only support dual pwm device now */
     mDevInfo = new DevInfo_t[2];
+    for (int i = 0; i < 2; i++) {
+        mDevInfo[i].pwm_port = i;
+        mDevInfo[i].pwm_period = 0;
+        mDevInfo[i].pwm_duty = -1;
+        mDevInfo[i].sbus_channel = -1;
+        mDevInfo[i].duty_fd = -1;
+        mDevInfo[i].period_fd = -1;
+        mDevInfo[i].enable_fd = -1;
+    }
 
-    loadSettings();
+    mValid = loadSettings();
 }
 
 BoardControl::~BoardControl()
 {
+    for (int i = 0; i < 2; i++)
+        closePwmDev(&mDevInfo[i]);
     delete mLoader;
     delete[] mDevInfo;
 }
 
-void BoardControl::loadSettings()
+bool BoardControl::isValid()
 {
-    mLoader->loadConfig(mFileName);
+    return mValid;
+}
 
-    ALOGI("board control: load setting file:%s\n", mFileName.c_str());
+bool BoardControl::reloadSettings()
+{
+    if (!loadSettings())
+        return false;
 
-    mLoader->beginSection("Other_config");
-    mControlSbus = mLoader->getInt("board_control_sbus", 0) - 1;
-    mLoader->endSection();
+    mValid = true;
+    return true;
+}
 
+/*
+ * Runs on the thread that owns the loader. The devices are not touched
+ * here, controlDev picks the new generation up on the board control
+ * thread, so sysfs is only accessed while board control is active.
+ */
+bool BoardControl::loadSettings()
+{
+    ConfigSchema schema(mLoader, mFileName);
+    Settings_t *settings;
+
+    if (!mLoader->loadConfig(mFileName)) {
+        ALOGE("board control: load setting file:%s failed\n", mFileName.c_str());
+        return false;
+    }
+
+    ALOGI("board control: load setting file:%s\n", mFileName.c_str());
+
+    settings = new Settings_t;
     /* get dual pwm config */
+    for (int i = 0; i < 2; i++)
+        schema.bind(sPwmFields, sizeof(sPwmFields) / sizeof(sPwmFields[0]), &settings->pwm[i], NULL, i + 1);
+    if (!schema.report()) {
+        /* the running settings, if any, stay in use */
+        delete settings;
+        return false;
+    }
+
+    for (int i = 0; i < 2; i++)
+        ALOGI("board control pwm dev:%d,%d,%d\n", i, settings->pwm[i].period, settings->pwm[i].channel - 1);
+
+    settings->generation = ++mGeneration;
+    mSettings.publish(settings);
+
+    return true;
+}
+
+void BoardControl::closePwmDev(DevInfo_t *dev)
+{
+    if (dev->duty_fd >= 0)
+        close(dev->duty_fd);
+    if (dev->period_fd >= 0)
+        close(dev->period_fd);
+    if (dev->enable_fd >= 0)
+        close(dev->enable_fd);
+    dev->duty_fd = -1;
+    dev->period_fd = -1;
+    dev->enable_fd = -1;
+}
+
+/* bring the devices in line with settings, only what changed is touched */
+void BoardControl::applySettings(const Settings_t *settings)
+{
     for (int i = 0; i < 2; i++) {
-        ostringstream oss;
-        oss << "Device_pwm_" << (i + 1);
-        mLoader->beginSection(oss.str());
-        mDevInfo[i].pwm_port = i;
-        mDevInfo[i].pwm_period = mLoader->getInt("pwm_period", 0);
-        mDevInfo[i].sbus_channel = mLoader->getInt("sbus_channel", 0) - 1;
-        ALOGI("board control pwm dev:%d,%d,%d\n", mDevInfo[i].pwm_port, mDevInfo[i].pwm_period, mDevInfo[i].sbus_channel);
-        if ((mDevInfo[i].sbus_channel >= 0) && !initPwmDev(mDevInfo[i].pwm_port, mDevInfo[i].pwm_period))
+        DevInfo_t *dev = &mDevInfo[i];
+        int channel = settings->pwm[i].channel - 1;
+        int period = settings->pwm[i].period;
+
+        if (channel < 0) {
+            if (dev->enable_fd >= 0) {
+                /* no longer mapped, stop the output */
+                sysfs_attr_write(dev->enable_fd, 0);
+                ALOGI("board control pwm dev:%d disabled\n", dev->pwm_port);
+            }
+            closePwmDev(dev);
+            dev->sbus_channel = -1;
+            continue;
+        }
+
+        dev->sbus_channel = channel;
+        if (dev->enable_fd >= 0 && dev->pwm_period == period)
+            continue;
+
+        closePwmDev(dev);
+        dev->pwm_period = period;
+        dev->pwm_duty = -1;
+        if (!initPwmDev(dev)) {
             ALOGE("init pwm device failed\n");
-        mLoader->endSection();
+            closePwmDev(dev);
+            dev->sbus_channel = -1;
+            continue;
+        }
+        dev->pwm_duty = 0;
+        ALOGI("board control pwm dev:%d,%d,%d\n", dev->pwm_port, dev->pwm_period, dev->sbus_channel);
     }
+
+    mAppliedGeneration = settings->generation;
 }
 
-bool BoardControl::initPwmDev(int port, int period)
+bool BoardControl::initPwmDev(DevInfo_t *dev)
 {
-    string period_str, duty_str, enable_str;
-
-    if (port >= 2) {
-        ALOGE("invalid parameter port:%d\n", port);
+    if (dev->pwm_port >= 2) {
+        ALOGE("invalid parameter port:%d\n", dev->pwm_port);
         return false;
     }
 
-    if (!setValue(PWM_EXPORT_PATH, port))
+    if (!setValue(PWM_EXPORT_PATH, dev->pwm_port))
         return false;
 
+    dev->duty_fd = open_pwm_attr(dev->pwm_port, "duty_cycle");
+    dev->period_fd = open_pwm_attr(dev->pwm_port, "period");
+    dev->enable_fd = open_pwm_attr(dev->pwm_port, "enable");
+
     /* set duty_cyce first(default value is 0), then set period */
-    PWM_PATH(port, duty_str, PWM_BASE_PATH, "duty_cycle");
-    if (!setValue(duty_str, 0))
+    if (!sysfs_attr_write(dev->duty_fd, 0))
         return false;
 
-    PWM_PATH(port, period_str, PWM_BASE_PATH, "period");
-    if (!setValue(period_str, period))
+    if (!sysfs_attr_write(dev->period_fd, dev->pwm_period))
         return false;
 
-    PWM_PATH(port, enable_str, PWM_BASE_PATH, "enable");
-    if (!setValue(enable_str, 1))
+    if (!sysfs_attr_write(dev->enable_fd, 1))
         return false;
 
     return true;
@@ -96,18 +198,31 @@ bool BoardControl::initPwmDev(int port, int period)
 
 void BoardControl::controlDev(uint8_t data[][25])
 {
-    string duty_str;
+    Settings_t pending;
 
     if (data == NULL || !parseSbusData(data))
         return;
 
+    pending.generation = mAppliedGeneration;
+    {
+        RcuPtr<Settings_t>::ReadGuard settings(mSettings);
+
+        /* nothing loaded yet */
+        if (settings.get() == NULL)
+            return;
+        if (settings->generation != mAppliedGeneration)
+            pending = *settings;
+    }
+    /* sysfs setup runs outside the read section, publish never waits on it */
+    if (pending.generation != mAppliedGeneration)
+        applySettings(&pending);
+
     /* control dual pwm device */
     for (int i = 0; i < 2; i++) {
         if ((mDevInfo[i].sbus_channel >= 0) && mDevInfo[i].pwm_duty != mSbusChannelData[mDevInfo[i].sbus_channel]) {
-            PWM_PATH(mDevInfo[i].pwm_port, duty_str, PWM_BASE_PATH, "duty_cycle");
             if (mSbusChannelData[mDevInfo[i].sbus_channel] > 100)
                mSbusChannelData[mDevInfo[i].sbus_channel] = 100;
-            setValue(duty_str, mSbusChannelData[mDevInfo[i].sbus_channel] * (mDevInfo[i].pwm_period / 100));
+            sysfs_attr_write(mDevInfo[i].duty_fd, mSbusChannelData[mDevInfo[i].sbus_channel] * (mDevInfo[i].pwm_period / 100));
             mDevInfo[i].pwm_duty = mSbusChannelData[mDevInfo[i].sbus_channel];
         }
     }
@@ -134,36 +249,13 @@ void BoardControl::controlDev(uint8_t data[][25])
  */
 bool BoardControl::parseSbusData(uint8_t data[][25])
 {
-    uint16_t *d = mSbusChannelData;
-    /* channel data */
-    uint8_t *s = *data + 1;
-
-    #define F(v, s) (((v) >> (s)) & 0x7ff)
-
-    if (*data[0] != 0x0f || *data[24] != 0x00) {
-        ALOGE("Error format sbus:%d data, and sof:0x%x, eof:0x%x\n", mControlSbus, *data[0], *data[24]);
+    if ((*data)[0] != SBUS_STARTBYTE || (*data)[24] != SBUS_ENDBYTE) {
+        ALOGE("Error format board control sbus data, and sof:0x%x, eof:0x%x\n", (*data)[0], (*data)[24]);
         return false;
     }
 
-    /* unroll channels 1-8 */
-    *d++ = F(s[0] | s[1] << 8, 0);
-    *d++ = F(s[1] | s[2] << 8, 3);
-    *d++ = F(s[2] | s[3] << 8 | s[4] << 16, 6);
-    *d++ = F(s[4] | s[5] << 8, 1);
-    *d++ = F(s[5] | s[6] << 8, 4);
-    *d++ = F(s[6] | s[7] << 8 | s[8] << 16, 7);
-    *d++ = F(s[8] | s[9] << 8, 2);
-    *d++ = F(s[9] | s[10] << 8, 5);
-
-    /* unroll channels 9-16 */
-    *d++ = F(s[11] | s[12] << 8, 0);
-    *d++ = F(s[12] | s[13] << 8, 3);
-    *d++ = F(s[13] | s[14] << 8 | s[15] << 16, 6);
-    *d++ = F(s[15] | s[16] << 8, 1);
-    *d++ = F(s[16] | s[17] << 8, 4);
-    *d++ = F(s[17] | s[18] << 8 | s[19] << 16, 7);
-    *d++ = F(s[19] | s[20] << 8, 2);
-    *d++ = F(s[20] | s[21] << 8, 5);
+    /* channel data */
+    sbus_unpack(*data + 1, mSbusChannelData);
 
     /* the data[23] don't care */
     return true;
@@ -14,9 +14,17 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <charconv>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "config_loader.h"
 
 ConfigLoader::ConfigLoader()
+    : _hasSection(false)
 {
 
 }
@@ -33,189 +41,277 @@ bool ConfigLoader::isSpace(char c)
     return false;
 }
 
-void ConfigLoader::trim(string &str)
+string_view ConfigLoader::trim(string_view str)
 {
-    if (str.empty())
-        return;
+    while (!str.empty() && (isSpace(str.front()) || str.front() == '\r'))
+        str.remove_prefix(1);
+    while (!str.empty() && (isSpace(str.back()) || str.back() == '\r'))
+        str.remove_suffix(1);
 
-    int i, start_pos, end_pos;
-    for (i = 0; i < (int)str.size(); i++) {
-        if (!isSpace(str[i])) {
-            break;
-        }
+    return str;
+}
+
+/* FNV-1a over section, a separator and key */
+uint32_t ConfigLoader::hash(string_view section, string_view key)
+{
+    uint32_t h = 2166136261u;
+
+    for (char c : section)
+        h = (h ^ (uint8_t)c) * 16777619u;
+    h = (h ^ 0xff) * 16777619u;
+    for (char c : key)
+        h = (h ^ (uint8_t)c) * 16777619u;
+
+    return h;
+}
+
+bool ConfigLoader::readFile(const string &filename)
+{
+    struct stat st;
+    size_t len = 0;
+    ssize_t n;
+    int fd;
+
+    fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
     }
-    if (i == (int)str.size()) {
-        str == "";
-        return;
+
+    _buffer.resize(st.st_size);
+    while (len < _buffer.size()) {
+        n = read(fd, &_buffer[len], _buffer.size() - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
     }
-    start_pos = i;
-    for (i = (int)str.size() - 1; i >= 0; i--) {
-        if (!isSpace(str[i])) {
+    close(fd);
+
+    /* the file may have been truncated meanwhile */
+    _buffer.resize(len);
+
+    return true;
+}
+
+uint32_t *ConfigLoader::findSlot(string_view section, string_view key)
+{
+    size_t mask = _index.size() - 1;
+    size_t i = hash(section, key) & mask;
+
+    /* the table is never more than half full, so there is always an empty slot */
+    while (_index[i]) {
+        const Entry &e = _entries[_index[i] - 1];
+        if (e.key == key && e.section == section)
             break;
-        }
+        i = (i + 1) & mask;
     }
-    end_pos = i;
-    str = str.substr(start_pos, end_pos - start_pos + 1);
+
+    return &_index[i];
 }
 
-bool ConfigLoader::parseLine(const string &line, string &section, string &key, string &value)
+void ConfigLoader::addEntry(string_view section, string_view key, string_view value)
 {
-    if (line.empty())
-        return false;
-    int start_pos = 0;
-    int end_pos = line.size()-1;
-    int pos, s_startpos, s_endpos;
+    uint32_t *slot = findSlot(section, key);
+
+    /* a repeated key overrides the earlier one */
+    if (*slot) {
+        _entries[*slot - 1].value = value;
+        return;
+    }
+
+    _entries.push_back({ section, key, value });
+    *slot = _entries.size();
+}
+
+void ConfigLoader::parseLine(char *line, size_t len, string_view &section)
+{
+    string_view str(line, len), key, value;
+    size_t pos, s_startpos, s_endpos;
 
     /* parse line contains comments */
-    if ((pos = line.find('#')) != -1) {
-        if (0 == pos) {
-            return false;
-        }
-        end_pos = pos - 1;
+    if ((pos = str.find('#')) != string_view::npos) {
+        if (0 == pos)
+            return;
+        str = str.substr(0, pos);
     }
 
     /* parse section line contains '[' and ']' */
-    if ((s_startpos = line.find('[')) != -1 && ((s_endpos = line.find(']')) != -1)) {
-        section = line.substr(s_startpos + 1, s_endpos - s_startpos - 1);
-        return true;
+    if ((s_startpos = str.find('[')) != string_view::npos &&
+        (s_endpos = str.find(']', s_startpos)) != string_view::npos) {
+        section = str.substr(s_startpos + 1, s_endpos - s_startpos - 1);
+        if (find_if(_sections.begin(), _sections.end(),
+                    [&](string_view s) { return s == section; }) == _sections.end())
+            _sections.push_back(section);
+        return;
     }
 
     /* parse key-value line */
-    string new_line = line.substr(start_pos, end_pos - start_pos + 1);
-    if ((pos = new_line.find('=')) == -1) {
+    if ((pos = str.find('=')) == string_view::npos) {
         /* key-value format error */
-        return false;
+        return;
     }
-    key = new_line.substr(0, pos);
-    value = new_line.substr(pos + 1, end_pos - pos);
-    trim(key);
+    key = trim(str.substr(0, pos));
     if (key.empty())
-        return false;
-    trim(value);
-    if ((pos = value.find("\r")) > 0) {
-        value.replace(pos, 1, "");
-    }
-    if ((pos = value.find("\n")) > 0) {
-        value.replace(pos, 1, "");
-    }
+        return;
+    value = trim(str.substr(pos + 1));
 
-    return true;
+    /* terminate in place so the value can be handed to strtof */
+    line[value.data() + value.size() - line] = '\0';
+    addEntry(section, key, value);
 }
 
 bool ConfigLoader::loadConfig(const string &filename)
 {
-    _settings.clear();
-    ifstream infile(filename.c_str());
-    if (!infile) {
+    string_view section;
+    size_t start, end, slots = 16;
+
+    _entries.clear();
+    _sections.clear();
+    _hasSection = false;
+    _curSection = string_view();
+
+    if (!readFile(filename)) {
+        _buffer.clear();
+        _index.assign(slots, 0);
         return false;
     }
 
-    string line;
-    string section, key, value;
-    map<string, string> keyValue;
-    map<string, map<string, string>>::iterator it;
-
-    while (getline(infile, line)) {
-        if (parseLine(line, section, key, value)) {
-            it = _settings.find(section);
-            if (it != _settings.end()) {
-                keyValue[key] = value;
-                it->second = keyValue;
-            } else {
-                keyValue.clear();
-                _settings.insert(make_pair(section, keyValue));
-            }
-        }
-        key.clear();
-        value.clear();
-    }
-    infile.close();
+    /* at most one entry per '=', keep the table at most half full */
+    while (slots < 2 * (size_t)count(_buffer.begin(), _buffer.end(), '='))
+        slots <<= 1;
+    _index.assign(slots, 0);
+
+    for (start = 0; start < _buffer.size(); start = end + 1) {
+        end = _buffer.find('\n', start);
+        if (end == string::npos)
+            end = _buffer.size();
+        if (end > start)
+            parseLine(&_buffer[start], end - start, section);
+    }
+
     return true;
 }
 
+const ConfigLoader::Entry *ConfigLoader::find(const char *key)
+{
+    uint32_t *slot;
+
+    if (!_hasSection || _index.empty())
+        return NULL;
+
+    slot = findSlot(_curSection, key);
+
+    return *slot ? &_entries[*slot - 1] : NULL;
+}
+
 int ConfigLoader::getInt(const char *key, const int &default_value)
 {
-    if (_curSection.empty()) {
-        return default_value;
-    }
-    map<string, string>::iterator item;
-    item = _curSection.find(key);
-    if (item == _curSection.end()) {
+    const Entry *item = find(key);
+    int value = 0;
+
+    if (item == NULL) {
         return default_value;
     }
 
-    return atoi(item->second.c_str());
+    /* same as atoi, a malformed number reads as 0 */
+    const char *first = item->value.data(), *last = first + item->value.size();
+    if (first != last && *first == '+')
+        first++;
+    if (from_chars(first, last, value).ec != errc())
+        return 0;
+
+    return value;
 }
 
 float ConfigLoader::getFloat(const char *key, const float &default_value)
 {
-    if (_curSection.empty()) {
-        return default_value;
-    }
-    map<string, string>::iterator item;
-    item = _curSection.find(key);
-    if (item == _curSection.end()) {
+    const Entry *item = find(key);
+
+    if (item == NULL) {
         return default_value;
     }
 
-    return atof(item->second.c_str());
+    return strtof(item->value.data(), NULL);
 }
 
 bool ConfigLoader::getBool(const char *key, const bool &default_value)
 {
-    if (_curSection.empty()) {
-        return default_value;
-    }
-    map<string, string>::iterator item;
-    item = _curSection.find(key);
-    if (item == _curSection.end()) {
+    const Entry *item = find(key);
+
+    if (item == NULL) {
         return default_value;
     }
 
-    if (item->second.compare("true") == 0) {
-        return true;
-    } else {
-        return false;
-    }
+    return item->value == "true";
 }
 
 string ConfigLoader::getStr(const char *key, const string &default_value)
 {
-    if (_curSection.empty()) {
+    const Entry *item = find(key);
+
+    if (item == NULL) {
         return default_value;
     }
-    map<string, string>::iterator item;
-    item = _curSection.find(key);
-    if (item == _curSection.end()) {
+
+    return string(item->value);
+}
+
+string_view ConfigLoader::getStrView(const char *key, string_view default_value)
+{
+    const Entry *item = find(key);
+
+    if (item == NULL) {
         return default_value;
     }
 
-    return item->second;
+    return item->value;
 }
 
-void ConfigLoader::beginSection(const string &section)
+bool ConfigLoader::lookup(const char *key, string_view &value)
 {
-    if (!_curSection.empty()) {
-        _curSection.clear();
-    }
-    if (_settings.find(section) != _settings.end()){
-        _curSection = _settings.find(section)->second;
+    const Entry *item = find(key);
+
+    if (item == NULL) {
+        return false;
     }
+
+    value = item->value;
+    return true;
+}
+
+void ConfigLoader::beginSection(string_view section)
+{
+    vector<string_view>::iterator it;
+
+    it = find_if(_sections.begin(), _sections.end(), [&](string_view s) { return s == section; });
+    _hasSection = it != _sections.end();
+    _curSection = _hasSection ? *it : string_view();
 }
 
 void ConfigLoader::endSection()
 {
-    _curSection.clear();
+    _hasSection = false;
+    _curSection = string_view();
 }
 
 list<string> ConfigLoader::getSectionKeys()
 {
     list<string> keys;
 
-    map<string, string>::iterator it;
-    for (it = _curSection.begin(); it != _curSection.end(); it++) {
-        keys.push_back(it->first);
+    if (!_hasSection)
+        return keys;
+
+    for (const Entry &e : _entries) {
+        if (e.section == _curSection)
+            keys.push_back(string(e.key));
     }
+    /* sorted, as the keys came out of a map before */
+    keys.sort();
 
     return keys;
 }
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <charconv>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <utils/Log.h>
+#include "config_schema.h"
+
+#define CONFIG_NAME_LEN 64
+
+ConfigSchema::ConfigSchema(ConfigLoader *loader, const string &filename)
+    : mLoader(loader)
+    , mFileName(filename)
+{
+
+}
+
+void ConfigSchema::error(const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    mErrors.push_back(buf);
+}
+
+bool ConfigSchema::ok() const
+{
+    return mErrors.empty();
+}
+
+bool ConfigSchema::report() const
+{
+    for (size_t i = 0; i < mErrors.size(); i++)
+        ALOGE("%s: %s\n", mFileName.c_str(), mErrors[i].c_str());
+
+    return ok();
+}
+
+static void set_int(uint8_t *dst, int value)
+{
+    memcpy(dst, &value, sizeof(value));
+}
+
+bool ConfigSchema::bindField(const ConfigField_t *field, uint8_t *dst, const char *section, const char *key)
+{
+    string_view value;
+    const char *first, *last;
+    from_chars_result res;
+    int i = 0;
+    float f;
+    char *end;
+
+    switch (field->type) {
+    case CONFIG_INT:
+        if (field->size != sizeof(int))
+            break;
+        if (!(field->flags & CONFIG_KEEP))
+            set_int(dst, (int)field->def);
+        if (!mLoader->lookup(key, value))
+            return true;
+
+        first = value.data();
+        last = first + value.size();
+        if (first != last && *first == '+')
+            first++;
+        res = from_chars(first, last, i);
+        if (res.ec != errc() || res.ptr != last || first == last) {
+            error("[%s] %s: '%.*s' is not an integer", section, key, (int)value.size(), value.data());
+            return true;
+        }
+        if (i < field->min || i > field->max) {
+            error("[%s] %s: %d out of range %g-%g", section, key, i, field->min, field->max);
+            return true;
+        }
+        set_int(dst, i);
+        return true;
+
+    case CONFIG_FLOAT:
+        if (field->size != sizeof(float))
+            break;
+        if (!(field->flags & CONFIG_KEEP)) {
+            f = field->def;
+            memcpy(dst, &f, sizeof(f));
+        }
+        if (!mLoader->lookup(key, value))
+            return true;
+
+        /* values are NUL terminated by the loader */
+        errno = 0;
+        f = strtof(value.data(), &end);
+        if (value.empty() || end != value.data() + value.size() || errno == ERANGE) {
+            error("[%s] %s: '%.*s' is not a number", section, key, (int)value.size(), value.data());
+            return true;
+        }
+        if (f < field->min || f > field->max) {
+            error("[%s] %s: %g out of range %g-%g", section, key, f, field->min, field->max);
+            return true;
+        }
+        memcpy(dst, &f, sizeof(f));
+        return true;
+
+    case CONFIG_BOOL:
+        if (field->size != sizeof(bool))
+            break;
+        if (!(field->flags & CONFIG_KEEP))
+            *(bool *)dst = field->def != 0;
+        if (!mLoader->lookup(key, value))
+            return true;
+
+        if (value == "true") {
+            *(bool *)dst = true;
+        } else if (value == "false") {
+            *(bool *)dst = false;
+        } else {
+            error("[%s] %s: '%.*s' is not true or false", section, key, (int)value.size(), value.data());
+        }
+        return true;
+
+    case CONFIG_STR:
+        if (!(field->flags & CONFIG_KEEP))
+            snprintf((char *)dst, field->size, "%s", field->defStr ? field->defStr : "");
+        if (!mLoader->lookup(key, value))
+            return true;
+
+        if (value.size() >= field->size) {
+            error("[%s] %s: '%.*s' longer than %zu", section, key, (int)value.size(), value.data(), field->size - 1);
+            return true;
+        }
+        memcpy(dst, value.data(), value.size());
+        dst[value.size()] = '\0';
+        return true;
+
+    case CONFIG_ENUM:
+        if (field->size != sizeof(int))
+            break;
+        if (!mLoader->lookup(key, value)) {
+            if (field->flags & CONFIG_KEEP)
+                return true;
+            value = field->defStr;
+        }
+
+        for (const ConfigEnum_t *e = field->enums; e->name; e++) {
+            if (value == e->name) {
+                set_int(dst, e->value);
+                return true;
+            }
+        }
+        error("[%s] %s: unknown value '%.*s'", section, key, (int)value.size(), value.data());
+        return true;
+    }
+
+    return false;
+}
+
+void ConfigSchema::bind(const ConfigField_t *fields, size_t count, void *base, const char *section, int index)
+{
+    char section_name[CONFIG_NAME_LEN] = "", key_name[CONFIG_NAME_LEN];
+    char cur[CONFIG_NAME_LEN] = "";
+
+    for (size_t i = 0; i < count; i++) {
+        const ConfigField_t *field = &fields[i];
+
+        /* names are only formatted with an index, other names may contain a % */
+        if (!field->section)
+            snprintf(section_name, sizeof(section_name), "%s", section ? section : "");
+        else if (index >= 0)
+            snprintf(section_name, sizeof(section_name), field->section, index);
+        else
+            snprintf(section_name, sizeof(section_name), "%s", field->section);
+        if (index >= 0)
+            snprintf(key_name, sizeof(key_name), field->key, index);
+        else
+            snprintf(key_name, sizeof(key_name), "%s", field->key);
+
+        if (i == 0 || strcmp(cur, section_name)) {
+            mLoader->beginSection(section_name);
+            strcpy(cur, section_name);
+        }
+
+        if (!bindField(field, (uint8_t *)base + field->offset, section_name, key_name))
+            error("[%s] %s: field size %zu does not match its type", section_name, key_name, field->size);
+    }
+
+    mLoader->endSection();
+}
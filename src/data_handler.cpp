@@ -14,13 +14,14 @@
  * limitations under the License.
  */
 
-#include <fstream>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <cutils/uevent.h>
 #include "rc_utils.h"
 #include "data_handler.h"
 
 #define PPM_DATA_NUM 8
+#define PPM_SAMPLE_INTERVAL_NS (1000000000LL / 50)
 
 static const char *PPM_INPUT_PATH[2] = { "/sys/bus/i2c/drivers/rc-io/5-0035/rcio_ppm0",
                                         "/sys/bus/i2c/drivers/rc-io/5-0035/rcio_ppm1" };
@@ -28,7 +29,13 @@ static const char *PPM_INPUT_PATH[2] = { "/sys/bus/i2c/drivers/rc-io/5-0035/rcio
 static const char *SBUS_MSG_FORMAT = "SBUS%d_ENABLE=";
 static const char *PPM_MSG_FORMAT = "PPM%d_ENABLE=";
 
+/* a few frames per read, the decoder keeps what doesn't fit */
+#define SBUS_READ_SIZE 256
+#define SBUS_STATS_INTERVAL_NS (10 * 1000000000LL)
+
 static const uint32_t EPOLL_ID_UEVENT = 0x80000002;
+static const uint32_t EPOLL_ID_PPM_TIMER = 0x80000003;
+static const uint32_t EPOLL_ID_PPM = 0x80000010;
 static const int EPOLL_SIZE_HINT = 8;
 static const int EPOLL_MAX_EVENTS = 16;
 static int epollFd;
@@ -36,9 +43,14 @@ static int epollFd;
 DataHandler::DataHandler(struct gnd_service_config *config)
     : Handler(config)
     , mPPMMask(0)
+    , mPPMNotifyMask(0)
+    , mPPMReadMask(0)
+    , mPPMTimerFd(-1)
+    , mPPMTimerArmed(false)
 {
     memset(mSbusFds, 0, sizeof(mSbusFds));
-    pthread_mutex_init(&mPPMLock, NULL);
+    mPPMFds[0] = mPPMFds[1] = -1;
+    memset(mSbusStatsNs, 0, sizeof(mSbusStatsNs));
 }
 
 DataHandler::~DataHandler()
@@ -47,10 +59,13 @@ DataHandler::~DataHandler()
         if (mSbusFds[i] > 0) {
             close(mSbusFds[i]);
         }
+        if (mPPMFds[i] >= 0) {
+            close(mPPMFds[i]);
+        }
     }
 
-    timer_delete(mTimer);
-    pthread_mutex_destroy(&mPPMLock);
+    if (mPPMTimerFd >= 0)
+        close(mPPMTimerFd);
 }
 
 int DataHandler::initialize()
@@ -60,37 +75,48 @@ int DataHandler::initialize()
         return -1;
     }
 
-    initTimer();
+    if (initPPMTimer() < 0)
+        return -1;
     startPollThread();
 
     return 0;
 }
 
-void DataHandler::initTimer()
+/*
+ * PPM inputs are sampled from a timerfd in the poll thread's epoll set,
+ * so all of the handler's state is owned by that one thread.
+ */
+int DataHandler::initPPMTimer()
 {
-    struct sigevent evp;
-    struct itimerspec ts;
-
-    memset(&evp, 0, sizeof(struct sigevent));
-    memset(&ts, 0, sizeof(struct itimerspec));
-
-    evp.sigev_value.sival_ptr = (void *)this;
-    evp.sigev_notify = SIGEV_THREAD;
-    evp.sigev_notify_function = timerNotifyCb;
-    timer_create(CLOCK_MONOTONIC, &evp, &mTimer);
-
-    ts.it_value.tv_sec = 1;
-    ts.it_value.tv_nsec = 0;
-    ts.it_interval.tv_sec = 0;
-    ts.it_interval.tv_nsec = (1000000000 / 50);
-    timer_settime(mTimer, 0, &ts, NULL);
+    mPPMTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mPPMTimerFd < 0) {
+        ALOGE("Could not create ppm timerfd: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
 }
 
-void DataHandler::timerNotifyCb(union sigval val)
+/* tick only while some enabled ppm input has to be polled */
+void DataHandler::armPPMTimer()
 {
-    DataHandler *handler = (DataHandler *)val.sival_ptr;
+    struct itimerspec spec;
+    bool arm = mPPMMask & ~mPPMNotifyMask;
 
-    handler->readAndSendPPMData();
+    if (arm == mPPMTimerArmed)
+        return;
+
+    memset(&spec, 0, sizeof(spec));
+    if (arm) {
+        spec.it_value.tv_nsec = PPM_SAMPLE_INTERVAL_NS;
+        spec.it_interval.tv_nsec = PPM_SAMPLE_INTERVAL_NS;
+    }
+
+    if (timerfd_settime(mPPMTimerFd, 0, &spec, NULL) < 0) {
+        ALOGE("Could not arm ppm timerfd: %s", strerror(errno));
+        return;
+    }
+    mPPMTimerArmed = arm;
 }
 
 void DataHandler::startPollThread()
@@ -124,11 +150,14 @@ void *DataHandler::pollThreadFunc(void *arg)
         add_epoll_fd(epollFd, uevent_fd, data);
     }
 
+    epoll_data_t timerData;
+    timerData.u32 = EPOLL_ID_PPM_TIMER;
+    add_epoll_fd(epollFd, handler->mPPMTimerFd, timerData);
+
     int eventCount;
-    int size_already_read = 0, res = 0, pos = 0;
+    int res = 0;
     struct epoll_event eventItems[EPOLL_MAX_EVENTS];
-    uint8_t sbus_data[2][SBUS_DATA_LEN] = {"\0", "\0"};
-    uint8_t temp_sbus_data[2][SBUS_DATA_LEN] = {"\0", "\0"};
+    uint8_t buf[SBUS_READ_SIZE];
 
     ALOGD("Entering data epoll loop.");
     while (1) {
@@ -142,6 +171,18 @@ void *DataHandler::pollThreadFunc(void *arg)
                 }
             }
 
+            if (eventItem.data.u32 == EPOLL_ID_PPM_TIMER) {
+                uint64_t expirations;
+                if (read(handler->mPPMTimerFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    handler->readAndSendPPMData();
+                continue;
+            }
+
+            if (eventItem.data.u32 - EPOLL_ID_PPM < 2) {
+                handler->handlePPMEvent(eventItem.data.u32 - EPOLL_ID_PPM);
+                continue;
+            }
+
             if (eventItem.events & EPOLLIN) {
                 uint32_t sbus = eventItem.data.u32;
                 if (sbus >= 2) {
@@ -149,34 +190,10 @@ void *DataHandler::pollThreadFunc(void *arg)
                     continue;
                 }
 
-                res = read(handler->mSbusFds[sbus], sbus_data[sbus] + size_already_read, SBUS_DATA_LEN - size_already_read);
-                if (res >= 0) {
-                    size_already_read += res;
-                }
-
-                if (size_already_read >= SBUS_DATA_LEN) {
-                    if (sbus_data[sbus][0] != SBUS_STARTBYTE || sbus_data[sbus][SBUS_DATA_LEN - 1] != SBUS_ENDBYTE) {
-                        memcpy(temp_sbus_data[sbus], sbus_data[sbus], SBUS_DATA_LEN);
-                        for (pos = 1; pos < size_already_read; pos++) {
-                            if (temp_sbus_data[sbus][pos] == SBUS_STARTBYTE) {
-                                memset(sbus_data[sbus], 0, SBUS_DATA_LEN);
-                                memcpy(sbus_data[sbus], temp_sbus_data[sbus] + pos, size_already_read - pos);
-                                size_already_read -= pos;
-                                continue;
-                            }
-                        }
-                        if (pos >= SBUS_DATA_LEN) {
-                            memset(sbus_data[sbus], 0, SBUS_DATA_LEN);
-                            memset(temp_sbus_data[sbus], 0, SBUS_DATA_LEN);
-                            size_already_read = 0;
-                        }
-                    } else {
-                        handler->mSender->sendMessage(sbus, sbus_data[sbus]);
-                        memset(sbus_data[sbus], 0, SBUS_DATA_LEN);
-                        memset(temp_sbus_data[sbus], 0, SBUS_DATA_LEN);
-                        size_already_read = 0;
-                    }
-                }
+                res = read(handler->mSbusFds[sbus], buf, sizeof(buf));
+                if (res <= 0)
+                    continue;
+                handler->decodeSbusData(sbus, buf, res);
             }
         }
     }
@@ -184,35 +201,103 @@ void *DataHandler::pollThreadFunc(void *arg)
     return NULL;
 }
 
-int DataHandler::readAndSendPPMData()
+bool DataHandler::readPPMData(int ppm)
 {
-    uint16_t data[PPM_DATA_NUM];
-    int i;
+    int data[PPM_DATA_NUM];
+    int n = sysfs_attr_read(mPPMFds[ppm], data, PPM_DATA_NUM);
 
-    for (int ppm = 0; ppm < 2; ppm++) {
-        if (getPPMEnabled(ppm)) {
-            i = 0;
-            ifstream in(PPM_INPUT_PATH[ppm]);
-            if (!in) {
-                ALOGE("Connot open file %s : %s", PPM_INPUT_PATH[ppm], strerror(errno));
-                continue;
-            }
+    /* any completed read marks the pending sysfs event as seen */
+    if (n >= 0)
+        mPPMReadMask |= 1 << ppm;
 
-            while (!in.eof() && i < PPM_DATA_NUM) {
-                in >> data[i++];
-            }
-            in.close();
+    if (n != PPM_DATA_NUM) {
+        ALOGE("Cannot read %d ppm values from %s", PPM_DATA_NUM, PPM_INPUT_PATH[ppm]);
+        return false;
+    }
 
-            for (int ch = 0; ch < PPM_DATA_NUM; ch++) {
-                mSender->setChannelValue(ppm + 1, ch + 1, ppm_to_sbus(data[ch]));
-            }
-            mSender->sendMessage(ppm);
+    mSender->beginUpdate();
+    for (int ch = 0; ch < PPM_DATA_NUM; ch++) {
+        mSender->updateChannelValue(ppm + 1, ch + 1, ppm_to_sbus(data[ch]));
+    }
+    mSender->commitUpdate();
+
+    return true;
+}
+
+/*
+ * Timer tick, polls the ppm inputs whose driver doesn't notify changes.
+ */
+int DataHandler::readAndSendPPMData()
+{
+    uint32_t ppm_mask = 0;
+
+    for (int ppm = 0; ppm < 2; ppm++) {
+        if ((mPPMMask & ~mPPMNotifyMask) & (1 << ppm)) {
+            if (readPPMData(ppm))
+                ppm_mask |= 1u << ppm;
         }
     }
 
+    /* both ppm inputs in one datagram batch */
+    if (ppm_mask)
+        mSender->sendMessages(ppm_mask);
+
     return 0;
 }
 
+/*
+ * sysfs_notify on the attribute wakes the poll thread with EPOLLPRI. From
+ * the first notification on, the input is read on change only and the
+ * timer leaves it alone. kernfs reports EPOLLPRI for any attribute until
+ * it has been read once after open, so an event before that first read
+ * proves nothing about the driver.
+ */
+void DataHandler::handlePPMEvent(int ppm)
+{
+    if (!(mPPMMask & (1 << ppm)))
+        return;
+
+    if (mPPMReadMask & (1 << ppm)) {
+        mPPMNotifyMask |= 1 << ppm;
+        armPPMTimer();
+    }
+
+    if (readPPMData(ppm))
+        mSender->sendMessages(1u << ppm);
+}
+
+/*
+ * Every frame of the read is decoded, only the newest is forwarded: a
+ * frame carries the full channel state, older ones of the same read are
+ * already stale.
+ */
+void DataHandler::decodeSbusData(int sbus, const uint8_t *data, size_t len)
+{
+    SbusDecoder *decoder = &mSbusDecoders[sbus];
+    uint8_t frame[SBUS_DATA_LEN];
+    bool have_frame = false;
+    size_t taken;
+    int64_t now;
+
+    while (len) {
+        taken = decoder->push(data, len);
+        data += taken;
+        len -= taken;
+        while (decoder->next(frame))
+            have_frame = true;
+    }
+
+    if (have_frame)
+        mSender->sendMessage(sbus, frame);
+
+    now = monotonic_ns();
+    if (now - mSbusStatsNs[sbus] >= SBUS_STATS_INTERVAL_NS) {
+        ALOGI("sbus%d input frames:%llu, discarded bytes:%llu", sbus,
+              (unsigned long long)decoder->framesDecoded(), (unsigned long long)decoder->bytesDiscarded());
+        mSbusStatsNs[sbus] = now;
+    }
+}
+
 void DataHandler::updateSbusState(char *state)
 {
     char str[30];
@@ -247,6 +332,8 @@ void DataHandler::setSbusEnabled(int index, bool enabled)
 
     if (enabled) {
         epoll_data_t data;
+        /* bytes from before the port was disabled don't belong to new frames */
+        mSbusDecoders[index].reset();
         data.u32 = index;
         add_epoll_fd(epollFd, mSbusFds[index], data);
     } else {
@@ -278,24 +365,32 @@ void DataHandler::updatePPMState(char *state)
 
 void DataHandler::setPPMEnabled(int index, bool enabled)
 {
-    pthread_mutex_lock(&mPPMLock);
     if (enabled){
+        if (mPPMFds[index] < 0) {
+            epoll_data_t data;
+            if ((mPPMFds[index] = sysfs_attr_open(PPM_INPUT_PATH[index], O_RDONLY)) < 0)
+                return;
+            /*
+             * read once before polling, a fresh kernfs open reports
+             * EPOLLPRI until then even if the driver never notifies
+             */
+            if (readPPMData(index))
+                mSender->sendMessages(1u << index);
+            data.u32 = EPOLL_ID_PPM + index;
+            add_epoll_fd(epollFd, mPPMFds[index], data, EPOLLPRI);
+        }
         mPPMMask |= (1 << index);
     } else {
+        if (mPPMFds[index] >= 0) {
+            del_epoll_fd(epollFd, mPPMFds[index]);
+            close(mPPMFds[index]);
+            mPPMFds[index] = -1;
+        }
         mPPMMask &= (0xff ^ (1 << index));
+        mPPMNotifyMask &= (0xff ^ (1 << index));
+        mPPMReadMask &= (0xff ^ (1 << index));
     }
-    pthread_mutex_unlock(&mPPMLock);
-}
-
-bool DataHandler::getPPMEnabled(int index)
-{
-    bool ret;
-
-    pthread_mutex_lock(&mPPMLock);
-    ret = mPPMMask & (1 << index);
-    pthread_mutex_unlock(&mPPMLock);
-
-    return ret;
+    armPPMTimer();
 }
 
 #define UEVENT_MSG_LEN 2048
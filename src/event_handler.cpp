@@ -19,13 +19,14 @@
 #include <dirent.h>
 #include <linux/input.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/timerfd.h>
 #include "event_handler.h"
 #include "rc_utils.h"
 
 #define INPUT_PATH "/dev/input"
 #define SCAN_TIME 10
-#define DEFAULT_MID_VALUE     1000.f
 
 #define KEYACTION_DOWN KeyConfigManager::KeyAction_Down
 #define KEYACTION_UP KeyConfigManager::KeyAction_Up
@@ -34,7 +35,13 @@
 
 static const int EPOLL_SIZE_HINT = 8;
 static const int EPOLL_MAX_EVENTS = 16;
+/* input events drained per read(), a stick frame is a handful of them */
+static const int INPUT_EVENT_BATCH = 64;
 static const uint32_t EPOLL_ID_INOTIFY = 0x80000001;
+static const uint32_t EPOLL_ID_LONG_PRESS = 0x80000002;
+
+#define RELOAD_KEY_CONFIG       0x01
+#define RELOAD_JOYSTICK_CONFIG  0x02
 
 static const char *INPUT_DEVICES_NAME[] = { "gpio-keys", "mlx_joystick" };
 int EventHandler::sAxisCodes[] = {X, Y, Z, RZ, WHEEL};
@@ -46,6 +53,10 @@ inline static float avg(float x, float y) {
 EventHandler::EventHandler(struct gnd_service_config *config)
     : Handler(config)
     , mDeviceNum(0)
+    , mLongPressFd(-1)
+    , mReloadPending(0)
+    , mReloadFd(-1)
+    , mAxisEvents(0)
 {
     char key_filename[PATH_MAX];
     char js_filename[PATH_MAX];
@@ -61,7 +72,7 @@ EventHandler::EventHandler(struct gnd_service_config *config)
     *filename++ = '/';
     strcpy(filename, mConfig->js_filename);
 
-    mKeyConfig = new KeyConfigManager(key_filename, mConfig->supported_keys);
+    mKeyConfig = new KeyConfigManager(key_filename, mConfig->supported_keys, mSender);
     mJoystickConfig = new JoystickConfigManager(js_filename);
 
     mAxisCount = sizeof(sAxisCodes)/sizeof(sAxisCodes[0]);
@@ -71,12 +82,13 @@ EventHandler::EventHandler(struct gnd_service_config *config)
     mDeviceFds = new int[count];
     memset(mDeviceFds, 0, sizeof(int)*count);
 
+    /* one state per key slot of the key config */
+    mKeyStates.resize(mKeyConfig->getKeyCount());
     map<int, string>::iterator it;
     for (it = mConfig->supported_keys.begin(); it != mConfig->supported_keys.end(); it++) {
-        struct KeyState key_state;
-        memset(&key_state, 0, sizeof(key_state));
-        key_state.keyCode = it->first;
-        mKeyStatesMap.insert(make_pair(it->first, key_state));
+        struct KeyState *key_state = &mKeyStates[mKeyConfig->getKeySlot(it->first)];
+        memset(key_state, 0, sizeof(*key_state));
+        key_state->keyCode = it->first;
     }
 
     pthread_mutex_init(&mLock, NULL);
@@ -89,9 +101,14 @@ EventHandler::~EventHandler()
             close(mDeviceFds[i]);
         }
     }
-    mKeyStatesMap.clear();
+    mKeyStates.clear();
     mAxisInfoMap.clear();
 
+    if (mReloadFd >= 0)
+        close(mReloadFd);
+    if (mLongPressFd >= 0)
+        close(mLongPressFd);
+
     delete mKeyConfig;
     delete mJoystickConfig;
     delete[] mAxisValues;
@@ -104,6 +121,11 @@ int EventHandler::initialize()
 {
     int device_num = sizeof(INPUT_DEVICES_NAME) / sizeof(char *);
     int try_count = 0;
+
+    if (!mKeyConfig->isValid() || !mJoystickConfig->isValid()) {
+        ALOGE("invalid key or joystick config, not starting.");
+        return -1;
+    }
     do {
         /* wait for all input device created */
         usleep(500000);
@@ -125,10 +147,13 @@ int EventHandler::initialize()
 
     /* set initial value to send. */
     setKeyChannelDefaultValues();
-    updateJoystickChannelValues();
+    updateJoystickChannelValues(1);
 
-    if (mConfig->long_press_enabled) {
-        startLongPressThread();
+    if (mConfig->long_press_enabled && startLongPressTimer() < 0) {
+        return -1;
+    }
+    if (startReloadThread() < 0) {
+        return -1;
     }
     startPollThread();
 
@@ -225,42 +250,112 @@ close_fd:
     return 0;
 }
 
-void EventHandler::startLongPressThread()
+int EventHandler::startLongPressTimer()
+{
+    mLongPressFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (mLongPressFd < 0) {
+        ALOGE("Could not create long press timerfd: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* arm the timer for the earliest held key, or disarm it when none is */
+void EventHandler::armLongPressTimer()
+{
+    struct itimerspec spec;
+    int64_t deadline = 0;
+    vector<struct KeyState>::iterator it;
+
+    for (it = mKeyStates.begin(); it != mKeyStates.end(); it++) {
+        if (it->longPressDeadline && (!deadline || it->longPressDeadline < deadline))
+            deadline = it->longPressDeadline;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline / 1000000000LL;
+    spec.it_value.tv_nsec = deadline % 1000000000LL;
+    if (timerfd_settime(mLongPressFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+        ALOGE("Could not arm long press timer: %s", strerror(errno));
+}
+
+void EventHandler::handleLongPressTimer()
+{
+    vector<struct KeyState>::iterator it;
+    int64_t now = monotonic_ns();
+    int sbus, ch, value;
+
+    pthread_mutex_lock(&mLock);
+    for (it = mKeyStates.begin(); it != mKeyStates.end(); it++) {
+        if (!it->longPressDeadline || it->longPressDeadline > now)
+            continue;
+        it->longPressDeadline = 0;
+        it->isLongPress = true;
+        if (getChannelValue(it->keyCode, LONG_PRESS, &sbus, &ch, &value)) {
+            setChannelValue(sbus, ch, value);
+        }
+    }
+    armLongPressTimer();
+    pthread_mutex_unlock(&mLock);
+}
+
+int EventHandler::startReloadThread()
 {
     pthread_t thread;
 
-    if (pthread_create(&thread, NULL, longPressThreadFunc, (void *)this)) {
-        ALOGE("Failed to create thread to process long press.");
-        return;
+    mReloadFd = eventfd(0, EFD_CLOEXEC);
+    if (mReloadFd < 0) {
+        ALOGE("Could not create config reload eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if (pthread_create(&thread, NULL, reloadThreadFunc, (void *)this)) {
+        ALOGE("Failed to create thread to reload config.");
+        return -1;
     }
+
+    return 0;
 }
 
-void *EventHandler::longPressThreadFunc(void *arg)
+/*
+ * Config files are parsed here rather than on the input thread. The
+ * managers publish each new settings object as a whole, so the input
+ * thread keeps running on the previous one until the swap.
+ */
+void *EventHandler::reloadThreadFunc(void *arg)
 {
     EventHandler *handler = (EventHandler *)arg;
-    map<int, struct KeyState>::iterator it;
-    struct KeyState *keyState;
+    uint64_t count;
+    unsigned pending;
 
     while (1) {
-        pthread_mutex_lock(&handler->mLock);
-        struct timeval time;
-        gettimeofday(&time, NULL);
-        long current = (time.tv_sec*1000000 + time.tv_usec) / 1000;
-        long period = 0;
-        for (it = handler->mKeyStatesMap.begin(); it != handler->mKeyStatesMap.end(); it++) {
-            keyState = &it->second;
-            period = current - keyState->pressedTime;
-            if (keyState->isPressed && !keyState->isLongPress && (period >= 1000L)) {
-                int sbus, ch, value;
-                keyState->isLongPress = true;
-                if (handler->getChannelValue(keyState->keyCode, LONG_PRESS, &sbus, &ch, &value)) {
-                    handler->setChannelValue(sbus, ch, value);
-                }
-            }
+        /* changes made while parsing are picked up by the next round */
+        if (read(handler->mReloadFd, &count, sizeof(count)) != sizeof(count)) {
+            if (errno != EINTR)
+                ALOGE("config reload wait failed: %s", strerror(errno));
+            continue;
+        }
+
+        pending = handler->mReloadPending.exchange(0);
+        if (pending & RELOAD_KEY_CONFIG) {
+            ALOGD("Key config changed.");
+            handler->mKeyConfig->reloadSettings();
+            pthread_mutex_lock(&handler->mLock);
+            handler->setKeyChannelDefaultValues();
+            pthread_mutex_unlock(&handler->mLock);
+        }
+
+        if (pending & RELOAD_JOYSTICK_CONFIG) {
+            ALOGD("Joystick config changed.");
+            handler->mJoystickConfig->reloadSettings();
         }
-        pthread_mutex_unlock(&handler->mLock);
-        usleep(100000);
+
+        if (pending)
+            handler->notifyConfigChange();
     }
+
+    return NULL;
 }
 
 void EventHandler::startPollThread()
@@ -288,7 +383,7 @@ void *EventHandler::pollThreadFunc(void *arg)
     ALOGI("input device num: %d", handler->mDeviceNum);
     for (int i = 0; i < handler->mDeviceNum; i++) {
         epoll_data_t data;
-        data.fd = handler->mDeviceFds[i];
+        data.u32 = i;
         add_epoll_fd(epollFd, handler->mDeviceFds[i], data);
     }
 
@@ -302,11 +397,19 @@ void *EventHandler::pollThreadFunc(void *arg)
     data.u32 = EPOLL_ID_INOTIFY;
     add_epoll_fd(epollFd, inotify_fd, data);
 
+    /* long presses fire from this loop, no thread polls the held keys */
+    if (handler->mLongPressFd >= 0) {
+        data.u32 = EPOLL_ID_LONG_PRESS;
+        add_epoll_fd(epollFd, handler->mLongPressFd, data);
+    }
+
     char event_buf[512];
     int eventCount;
     struct epoll_event eventItems[EPOLL_MAX_EVENTS];
-    struct input_event event;
+    struct input_event events[INPUT_EVENT_BATCH];
     struct inotify_event *ievent;
+    /* per device slot, the queue overflowed and its events are void up to the next SYN_REPORT */
+    vector<bool> dropped(handler->mDeviceNum, false);
 
     ALOGD("Entering epoll loop.");
     while (1) {
@@ -338,17 +441,45 @@ void *EventHandler::pollThreadFunc(void *arg)
                 continue;
             }
 
+            if (eventItem.data.u32 == EPOLL_ID_LONG_PRESS) {
+                uint64_t expirations;
+                if (read(handler->mLongPressFd, &expirations, sizeof(expirations)) == sizeof(expirations))
+                    handler->handleLongPressTimer();
+                continue;
+            }
+
             if (eventItem.events & EPOLLIN) {
-                int res = read(eventItem.data.fd, &event, sizeof(event));
-                if (res < (int)sizeof(event)) {
-                    ALOGE("Could not get event from fd %d", eventItem.data.fd);
+                int slot = eventItem.data.u32;
+                int fd = handler->mDeviceFds[slot];
+                bool drop = dropped[slot];
+                int res = read(fd, events, sizeof(events));
+                if (res < (int)sizeof(events[0])) {
+                    ALOGE("Could not get event from fd %d", fd);
                     continue;
                 }
-                if (event.type == EV_KEY) {
-                    handler->handleKeyEvent(event.code, event.value);
-                } else if (event.type == EV_ABS) {
-                    handler->handleAxisEvent(event.code, event.value);
+                /* evdev only returns whole events */
+                int count = res / sizeof(events[0]);
+                for (int j = 0; j < count; j++) {
+                    const struct input_event& event = events[j];
+                    if (event.type == EV_SYN) {
+                        if (event.code == SYN_DROPPED) {
+                            ALOGW("Input events dropped on fd %d, resyncing.", fd);
+                            drop = true;
+                        } else if (event.code == SYN_REPORT) {
+                            if (drop)
+                                handler->syncAxisValues(fd);
+                            drop = false;
+                            handler->handleSyncEvent();
+                        }
+                    } else if (drop) {
+                        continue;
+                    } else if (event.type == EV_KEY) {
+                        handler->handleKeyEvent(event.code, event.value);
+                    } else if (event.type == EV_ABS) {
+                        handler->handleAxisEvent(event.code, event.value);
+                    }
                 }
+                dropped[slot] = drop;
             }
         }
     }
@@ -356,6 +487,7 @@ void *EventHandler::pollThreadFunc(void *arg)
 
 void EventHandler::setKeyChannelDefaultValues()
 {
+    mSender->beginUpdate();
     for (int sbus = 1; sbus <= 2; sbus++) {
         map<int, int> sbus_map = mKeyConfig->getSbusDefaultValues(sbus);
         for (int ch = 1; ch <= 16; ch++) {
@@ -363,14 +495,15 @@ void EventHandler::setKeyChannelDefaultValues()
                 continue;
 
             if (sbus_map.find(ch) != sbus_map.end()) {
-                if (MessageSender::getChannelValue(sbus, ch) == 0) {
-                    setChannelValue(sbus, ch, sbus_map[ch]);
+                if (mSender->getChannelValue(sbus, ch) == 0) {
+                    mSender->updateChannelValue(sbus, ch, sbus_map[ch]);
                 }
             } else {
-                setChannelValue(sbus, ch, 0);
+                mSender->updateChannelValue(sbus, ch, 0);
             }
         }
     }
+    mSender->commitUpdate();
 }
 
 void EventHandler::notifyConfigChange()
@@ -386,20 +519,25 @@ void EventHandler::notifyConfigChange()
 void EventHandler::handleKeyEvent(int keycode, int action)
 {
     int sbus, ch, value;
+    int slot = mKeyConfig->getKeySlot(keycode);
 
-    pthread_mutex_lock(&mLock);
-    if (mKeyStatesMap.find(keycode) == mKeyStatesMap.end()) {
+    if (slot < 0) {
         ALOGE("Unsupported key code %d, do not process.", keycode);
-        pthread_mutex_unlock(&mLock);
         return;
     }
 
-    struct KeyState *key_state = &mKeyStatesMap[keycode];
+    /* autorepeat of a held key, the long press timer covers holding */
+    if (action == ACTION_REPEAT)
+        return;
+
+    pthread_mutex_lock(&mLock);
+    struct KeyState *key_state = &mKeyStates[slot];
     if (action == ACTION_DOWN) {
-        struct timeval time;
-        gettimeofday(&time, NULL);
-        key_state->pressedTime = (time.tv_sec * 1000000 + time.tv_usec)/1000;
         key_state->isPressed = true;
+        if (mLongPressFd >= 0) {
+            key_state->longPressDeadline = monotonic_ns() + mKeyConfig->getLongPressMs(keycode) * 1000000LL;
+            armLongPressTimer();
+        }
         if (getChannelValue(keycode, KEYACTION_DOWN, &sbus, &ch, &value)) {
             setChannelValue(sbus, ch, value);
         }
@@ -412,9 +550,12 @@ void EventHandler::handleKeyEvent(int keycode, int action)
                 setChannelValue(sbus, ch, value);
             }
         }
-        key_state->pressedTime = 0;
         key_state->isPressed = false;
         key_state->isLongPress = false;
+        if (key_state->longPressDeadline) {
+            key_state->longPressDeadline = 0;
+            armLongPressTimer();
+        }
     }
     pthread_mutex_unlock(&mLock);
 }
@@ -430,7 +571,7 @@ bool EventHandler::getChannelValue(int keyCode, KeyConfigManager::KeyAction_t ac
 
 void EventHandler::setChannelValue(int sbus, int ch, int value)
 {
-    MessageSender::setChannelValue(sbus, ch, value);
+    mSender->setChannelValue(sbus, ch, value);
 }
 
 bool EventHandler::getScrollWheelSetting(int *sbus, int *channel)
@@ -438,70 +579,42 @@ bool EventHandler::getScrollWheelSetting(int *sbus, int *channel)
     return mKeyConfig->getScrollWheelSetting(sbus, channel);
 }
 
-void EventHandler::getJoystickControls(Controls_t *controls)
-{
-    mJoystickConfig->getJoystickControls(controls);
-}
-
 int EventHandler::getFunctionChannel(int function)
 {
     return mJoystickConfig->getFunctionChannel(function);
 }
 
-uint16_t EventHandler::adjustRange(uint16_t value, float half)
-{
-    uint16_t minChannelValue = mJoystickConfig->getMinChannelValue();
-    uint16_t maxChannelValue = mJoystickConfig->getMaxChannelValue();
-    uint16_t mid_value = minChannelValue + (maxChannelValue - minChannelValue) / 2;
-
-    if (value <= half) {
-        return (mid_value - ((half - value) / half * (mid_value - minChannelValue)));
-    } else {
-        return (mid_value + ((value - half) / half * (maxChannelValue - mid_value)));
-    }
-}
-
-void EventHandler::setManualControl(Controls_t controls)
+void EventHandler::updateJoystickChannelValues(int steps)
 {
-    const float axesScaling = 1.0 * 1000.0;
-
-    float ch[4];
-    ch[0] = (controls.roll + 1) * axesScaling;
-    ch[1] = (controls.pitch + 1) * axesScaling;
-    ch[2] = (controls.yaw + 1) * axesScaling;
-    ch[3] = controls.throttle * axesScaling;
-
-    for (int i = 0; i < 4; i++) {
-        if (i == JoystickConfigManager::throttleFunction) {
-            ch[i] = adjustRange(ch[i], DEFAULT_MID_VALUE / 2);
-        } else {
-            ch[i] = adjustRange(ch[i], DEFAULT_MID_VALUE);
-        }
-        setChannelValue(1, getFunctionChannel(i), ch[i]);
-    }
-
-    int sbus, channel, channelValue;
-    if (getScrollWheelSetting(&sbus, &channel)) {
-        channelValue = (int)(DEFAULT_MID_VALUE + controls.wheel * DEFAULT_MID_VALUE);
-        setChannelValue(sbus, channel, channelValue);
-    }
-}
+    uint16_t values[JoystickConfigManager::maxFunction];
+    int sbus, channel;
 
-void EventHandler::updateJoystickChannelValues()
-{
-    Controls_t controls;
+    /* get channel values of 5 functions. */
+    mJoystickConfig->getChannelValues(values, steps);
 
-    /* get values of 5 functions. */
-    getJoystickControls(&controls);
+    /* set values to MessageSender, the sender never sees half a stick frame. */
+    mSender->beginUpdate();
+    for (int i = 0; i < JoystickConfigManager::wheelFunction; i++)
+        mSender->updateChannelValue(1, getFunctionChannel(i), values[i]);
 
-    /* set values to MessageSender. */
-    setManualControl(controls);
+    if (getScrollWheelSetting(&sbus, &channel))
+        mSender->updateChannelValue(sbus, channel, values[JoystickConfigManager::wheelFunction]);
+    mSender->commitUpdate();
 }
 
+/*
+ * Axis events only record the new position. The joystick transform runs
+ * once per SYN_REPORT in handleSyncEvent, so an X and Y change of one
+ * stick movement are applied together. The events are still counted,
+ * the accumulator throttle integrates once per axis event as it did
+ * when every event ran the transform.
+ */
 void EventHandler::handleAxisEvent(int axiscode, int value)
 {
     float axis_value;
 
+    mAxisEvents++;
+
     if (mAxisInfoMap.find(axiscode) != mAxisInfoMap.end()) {
         axis_value = value * mAxisInfoMap[axiscode].scale + mAxisInfoMap[axiscode].offset;
     } else {
@@ -514,27 +627,53 @@ void EventHandler::handleAxisEvent(int axiscode, int value)
             mJoystickConfig->setAxisValue(i, mAxisValues[i]);
         }
     }
+}
 
-    updateJoystickChannelValues();
+void EventHandler::handleSyncEvent()
+{
+    int steps = mAxisEvents;
+
+    if (!steps)
+        return;
+
+    mAxisEvents = 0;
+    updateJoystickChannelValues(steps);
+}
+
+/* after SYN_DROPPED the queued axis events are lost, read the current state */
+void EventHandler::syncAxisValues(int fd)
+{
+    struct input_absinfo info;
+
+    for (int i = 0; i < mAxisCount; i++) {
+        if (mAxisInfoMap.find(sAxisCodes[i]) == mAxisInfoMap.end())
+            continue;
+        if (!ioctl(fd, EVIOCGABS(sAxisCodes[i]), &info))
+            handleAxisEvent(sAxisCodes[i], info.value);
+    }
 }
 
 void EventHandler::handleConfigEvent(const char *filename)
 {
+    unsigned reload = 0;
+    uint64_t one = 1;
+
     if (filename == NULL) {
         ALOGE("invalid parameter");
         return;
     }
 
-    if (!strcmp(filename, mConfig->key_filename)) {
-        ALOGD("Key config changed.");
-        mKeyConfig->reloadSettings();
-        setKeyChannelDefaultValues();
-    }
+    if (!strcmp(filename, mConfig->key_filename))
+        reload |= RELOAD_KEY_CONFIG;
 
-    if (!strcmp(filename, mConfig->js_filename)) {
-        ALOGD("Joystick config changed.");
-        mJoystickConfig->reloadSettings();
-    }
+    if (!strcmp(filename, mConfig->js_filename))
+        reload |= RELOAD_JOYSTICK_CONFIG;
 
-    notifyConfigChange();
+    if (!reload)
+        return;
+
+    /* hand over to the reload thread, the input loop never parses */
+    mReloadPending.fetch_or(reload);
+    if (write(mReloadFd, &one, sizeof(one)) < 0)
+        ALOGE("notify config reload failed: %s", strerror(errno));
 }
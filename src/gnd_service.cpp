@@ -15,6 +15,7 @@
  */
 
 #include "service.h"
+#include "config_schema.h"
 #include "event_handler.h"
 #include "data_handler.h"
 #include "tty_handler.h"
@@ -23,9 +24,54 @@ using namespace std;
 
 static struct gnd_service_config g_config;
 
+static const ConfigEnum_t send_mode_enums[] = {
+    { "periodic", MessageSender::SEND_PERIODIC },
+    { "change", MessageSender::SEND_ON_CHANGE },
+    { NULL, 0 },
+};
+
+static const ConfigField_t general_fields[] = {
+    CONFIG_FIELD_STR("General", "ConfigDir", struct gnd_service_settings, config_dir, ""),
+    CONFIG_FIELD_STR("General", "KeyconfigName", struct gnd_service_settings, key_filename, ""),
+    CONFIG_FIELD_STR("General", "JoystickconfigName", struct gnd_service_settings, js_filename, ""),
+    /* input source to get data, dafault is 0-input device. */
+    CONFIG_FIELD_INT("General", "InputSource", struct gnd_service_settings, input_src, INPUT_DEV, INPUT_DEV, TTY_DEV),
+
+    CONFIG_FIELD_STR("UdpConfig", "IpAddress", struct gnd_service_settings, ip, ""),
+    CONFIG_FIELD_INT("UdpConfig", "Port", struct gnd_service_settings, port, 16666, 1, 65535),
+    /* version 1 is understood by every air unit, 2 adds seq, time and crc */
+    CONFIG_FIELD_INT("UdpConfig", "MessageVersion", struct gnd_service_settings, msg_version, 1, 1, 2),
+    CONFIG_FIELD_ENUM("UdpConfig", "SendMode", struct gnd_service_settings, send_mode, "periodic", send_mode_enums),
+    /* SendMode=change: upper bound of the send rate */
+    CONFIG_FIELD_FLOAT("UdpConfig", "MaxSendFrequency", struct gnd_service_settings, max_send_frequency, 100, 1, 1000),
+
+    CONFIG_FIELD_BOOL("SbusCtrl", "Sbus1SendbyApp", struct gnd_service_settings, sbus1_send_by_app, false),
+};
+
+static const ConfigField_t input_fields[] = {
+    CONFIG_FIELD_BOOL("KeyConfig", "LongPressEnabled", struct gnd_service_settings, long_press_enabled, false),
+};
+
+static const ConfigField_t data_fields[] = {
+    CONFIG_FIELD_STR("DataConfig", "Sbus1Port", struct gnd_service_settings, sbus_ports[0], ""),
+    CONFIG_FIELD_STR("DataConfig", "Sbus2Port", struct gnd_service_settings, sbus_ports[1], ""),
+};
+
+struct key_code {
+    int code;
+};
+
+static void check_config_path(ConfigSchema &schema, const char *key, const char *dir, const char *name)
+{
+    if (strlen(dir) + 1 + strlen(name) >= PATH_MAX)
+        schema.error("[General] %s: path %s/%s too long", key, dir, name);
+}
+
 static int load_config(const string &filename)
 {
     ConfigLoader loader;
+    ConfigSchema schema(&loader, filename);
+    struct gnd_service_settings *settings = &g_config;
 
     if (filename.empty())
         return -EINVAL;
@@ -35,46 +81,36 @@ static int load_config(const string &filename)
         return -ENXIO;
     }
 
-    loader.beginSection("General");
-    strcpy(g_config.config_dir, loader.getStr("ConfigDir", "").c_str());
-    strcpy(g_config.key_filename, loader.getStr("KeyconfigName", "").c_str());
-    strcpy(g_config.js_filename, loader.getStr("JoystickconfigName", "").c_str());
-    /* input source to get data, dafault is 0-input device. */
-    g_config.input_src = loader.getInt("InputSource");
-    loader.endSection();
-
-    loader.beginSection("UdpConfig");
-    strcpy(g_config.ip, loader.getStr("IpAddress", "").c_str());
-    g_config.port = loader.getInt("Port", 16666);
-    loader.endSection();
-
-    loader.beginSection("SbusCtrl");
-    bool sbus1_enable = !loader.getBool("Sbus1SendbyApp");
-    g_config.send_sbus_num = sbus1_enable ? 2 : 1;
-    loader.endSection();
+    schema.bind(general_fields, sizeof(general_fields) / sizeof(general_fields[0]), settings);
+    g_config.send_sbus_num = g_config.sbus1_send_by_app ? 1 : 2;
 
     if (g_config.input_src == INPUT_DEV) {
         list<string> key_names;
         list<string>::iterator it;
         loader.beginSection("KeySet");
         key_names = loader.getSectionKeys();
+        loader.endSection();
         for (it = key_names.begin(); it != key_names.end(); it++) {
-            int code = loader.getInt(it->c_str());
-            g_config.supported_keys[code] = *it;
-            ALOGD("got a available key, name : %s, code : %d", g_config.supported_keys[code].c_str(), code);
+            ConfigField_t field = CONFIG_FIELD_INT("KeySet", it->c_str(), struct key_code, code, 0, 1, KEY_CODE_MAX);
+            struct key_code key;
+
+            schema.bind(&field, 1, &key);
+            if (key.code == 0)
+                continue;
+            g_config.supported_keys[key.code] = *it;
+            ALOGD("got a available key, name : %s, code : %d", g_config.supported_keys[key.code].c_str(), key.code);
         }
-        loader.endSection();
 
-        loader.beginSection("KeyConfig");
-        g_config.long_press_enabled = loader.getBool("LongPressEnabled");
-        loader.endSection();
+        schema.bind(input_fields, sizeof(input_fields) / sizeof(input_fields[0]), settings);
+        check_config_path(schema, "KeyconfigName", g_config.config_dir, g_config.key_filename);
+        check_config_path(schema, "JoystickconfigName", g_config.config_dir, g_config.js_filename);
     } else if (g_config.input_src == DATA_DEV || g_config.input_src == TTY_DEV) {
-        loader.beginSection("DataConfig");
-        strcpy(g_config.sbus_ports[0], loader.getStr("Sbus1Port", "").c_str());
-        strcpy(g_config.sbus_ports[1], loader.getStr("Sbus2Port", "").c_str());
-        loader.endSection();
+        schema.bind(data_fields, sizeof(data_fields) / sizeof(data_fields[0]), settings);
     }
 
+    if (!schema.report())
+        return -EINVAL;
+
     return 0;
 }
 
@@ -92,13 +128,17 @@ int gnd_main(int argc, char *argv[])
 
     if (g_config.input_src == INPUT_DEV) {
         handler = new EventHandler(&g_config);
-        handler->initialize();
     } else if (g_config.input_src == DATA_DEV) {
         handler = new DataHandler(&g_config);
-        handler->initialize();
-    } else if (g_config.input_src == TTY_DEV) {
+    } else {
         handler = new TTYHandler(&g_config);
-        handler->initialize();
+    }
+
+    result = handler->initialize();
+    if (result < 0) {
+        ALOGE("initialize input source %d failed\n", g_config.input_src);
+        delete handler;
+        return result;
     }
 
     /* main thread sleep */
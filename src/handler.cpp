@@ -19,7 +19,8 @@
 Handler::Handler(struct gnd_service_config *config)
     : mConfig(config)
 {
-    mSender = new MessageSender(mConfig->send_sbus_num);
+    mSender = new MessageSender(mConfig->send_sbus_num, mConfig->msg_version);
+    mSender->setSendMode((MessageSender::SendMode)mConfig->send_mode, mConfig->max_send_frequency);
 }
 
 Handler::~Handler()
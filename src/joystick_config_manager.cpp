@@ -20,20 +20,58 @@
 
 #define DEFAULT_MIN_CHANNEL_VALUE 364
 #define DEFAULT_MAX_CHANNEL_VALUE 1684
+#define DEFAULT_MID_CHANNEL_VALUE 1000.f
+
+#define SETTINGS_FIELD_INT(section, key, member, def, min, max) \
+    CONFIG_FIELD_INT(section, key, JoystickConfigManager::Settings_t, member, def, min, max)
+#define SETTINGS_FIELD_FLOAT(section, key, member, def, min, max) \
+    CONFIG_FIELD_FLOAT(section, key, JoystickConfigManager::Settings_t, member, def, min, max)
+#define SETTINGS_FIELD_BOOL(section, key, member, def) \
+    CONFIG_FIELD_BOOL(section, key, JoystickConfigManager::Settings_t, member, def)
+
+const ConfigField_t JoystickConfigManager::sSettingsFields[] = {
+    SETTINGS_FIELD_BOOL("Basic", "calibrated", calibrated, false),
+    SETTINGS_FIELD_INT("Basic", "transmitterMode", transmitterMode, 2, 1, 4),
+
+    /* a negative axis selects the default one of the function */
+    SETTINGS_FIELD_INT("Function", "RollAxis", functionAxis[rollFunction], rollFunction, -1, maxFunction - 1),
+    SETTINGS_FIELD_INT("Function", "PitchAxis", functionAxis[pitchFunction], pitchFunction, -1, maxFunction - 1),
+    SETTINGS_FIELD_INT("Function", "YawAxis", functionAxis[yawFunction], yawFunction, -1, maxFunction - 1),
+    SETTINGS_FIELD_INT("Function", "ThrottleAxis", functionAxis[throttleFunction], throttleFunction, -1, maxFunction - 1),
+    SETTINGS_FIELD_INT("Function", "WheelAxis", functionAxis[wheelFunction], wheelFunction, -1, maxFunction - 1),
+
+    SETTINGS_FIELD_INT("FunctionChannel", "RollChannel", functionChannels[rollFunction], 1, 0, 16),
+    SETTINGS_FIELD_INT("FunctionChannel", "PitchChannel", functionChannels[pitchFunction], 2, 0, 16),
+    SETTINGS_FIELD_INT("FunctionChannel", "YawChannel", functionChannels[yawFunction], 4, 0, 16),
+    SETTINGS_FIELD_INT("FunctionChannel", "ThrottleChannel", functionChannels[throttleFunction], 3, 0, 16),
+    SETTINGS_FIELD_INT("FunctionChannel", "WheelChannel", functionChannels[wheelFunction], 0, 0, 16),
+    SETTINGS_FIELD_INT("FunctionChannel", "MinChannelValue", minChannelValue, DEFAULT_MIN_CHANNEL_VALUE, 0, 2047),
+    SETTINGS_FIELD_INT("FunctionChannel", "MaxChannelValue", maxChannelValue, DEFAULT_MAX_CHANNEL_VALUE, 0, 2047),
+
+    SETTINGS_FIELD_FLOAT("Additional", "Exponential", exponential, 0, 0, 0.75),
+    SETTINGS_FIELD_BOOL("Additional", "Accumulator", accumulator, false),
+    SETTINGS_FIELD_BOOL("Additional", "Deadband", deadband, false),
+    SETTINGS_FIELD_BOOL("Additional", "CenterZeroSupport", centerZeroSupport, true),
+    SETTINGS_FIELD_INT("Additional", "ThrottleMode", throttleMode, ThrottleModeCenterZero, 0, ThrottleModeMax - 1),
+    SETTINGS_FIELD_BOOL("Additional", "NegativeThrust", negativeThrust, false),
+    SETTINGS_FIELD_FLOAT("Additional", "Frequency", frequency, 25.0f, 1, 1000),
+    SETTINGS_FIELD_BOOL("Additional", "CircleCorrection", circleCorrection, true),
+};
 
-const char* JoystickConfigManager::sFunctionSettingsKey[JoystickConfigManager::maxFunction] = {
-    "RollAxis",
-    "PitchAxis",
-    "YawAxis",
-    "ThrottleAxis",
-    "WheelAxis"
+const ConfigField_t JoystickConfigManager::sCalibrationFields[] = {
+    CONFIG_FIELD_INT("Axis%dCalibration", "AxisMin", Calibration_t, min, -32768, -32768, 32767),
+    CONFIG_FIELD_INT("Axis%dCalibration", "AxisMax", Calibration_t, max, 32767, -32768, 32767),
+    CONFIG_FIELD_INT("Axis%dCalibration", "AxisTrim", Calibration_t, center, 0, -32768, 32767),
+    CONFIG_FIELD_INT("Axis%dCalibration", "AxisDeadband", Calibration_t, deadband, 0, 0, 32767),
+    CONFIG_FIELD_BOOL("Axis%dCalibration", "AxisRev", Calibration_t, reversed, false),
 };
 
 JoystickConfigManager::JoystickConfigManager(const string &filename)
-    :mFileName(filename)
+    : mValid(false)
+    , mFileName(filename)
+    , mThrottleAccu(0.f)
 {
     mAxisCount = maxFunction;
-    mCalibrations = new Calibration_t[mAxisCount];
     mAxisValues = new int[mAxisCount];
 
     for (int i = 0; i < mAxisCount; i++) {
@@ -41,12 +79,11 @@ JoystickConfigManager::JoystickConfigManager(const string &filename)
     }
 
     mLoader = new ConfigLoader();
-    loadSettings();
+    mValid = loadSettings();
 }
 
 JoystickConfigManager::~JoystickConfigManager()
 {
-    delete[] mCalibrations;
     delete[] mAxisValues;
     delete mLoader;
 }
@@ -58,88 +95,129 @@ void JoystickConfigManager::setAxisValue(int axis, int value)
 
 int JoystickConfigManager::getFunctionChannel(int function)
 {
-    if (mFunctionChannels[function] > 0 && mFunctionChannels[function] <= 4) {
-        return mFunctionChannels[function];
+    RcuPtr<Settings_t>::ReadGuard settings(mSettings);
+
+    if (settings->functionChannels[function] > 0 && settings->functionChannels[function] <= 4) {
+        return settings->functionChannels[function];
     }
 
     return function + 1;
 }
 
-void JoystickConfigManager::getJoystickControls(Controls_t *controls)
+/* calibration and deadband, -1..1 */
+float JoystickConfigManager::normalizeAxis(const Settings_t &s, int function, int value)
 {
-    int     axis = mFunctionAxis[rollFunction];
-    float   roll = adjustRange(mAxisValues[axis], mCalibrations[axis], mDeadband);
+    bool deadband = s.deadband;
 
-            axis = mFunctionAxis[pitchFunction];
-    float   pitch = adjustRange(mAxisValues[axis], mCalibrations[axis], mDeadband);
+    if (function == throttleFunction && s.throttleMode == ThrottleModeDownZero)
+        deadband = false;
 
-            axis = mFunctionAxis[yawFunction];
-    float   yaw = adjustRange(mAxisValues[axis], mCalibrations[axis], mDeadband);
-
-            axis = mFunctionAxis[throttleFunction];
-    float   throttle = adjustRange(mAxisValues[axis], mCalibrations[axis], mThrottleMode == ThrottleModeDownZero ? false : mDeadband);
+    return adjustRange(value, s.calibrations[s.functionAxis[function]], deadband);
+}
 
-            axis = mFunctionAxis[wheelFunction];
-    float   wheel = adjustRange(mAxisValues[axis], mCalibrations[axis], mDeadband);
+/* circle correction, expo and throttle mode of a normalized value */
+float JoystickConfigManager::shapeAxis(const Settings_t &s, int function, float value)
+{
+    if (s.circleCorrection) {
+        float limited = std::max(static_cast<float>(-M_PI_4), std::min(value, static_cast<float>(M_PI_4)));
 
-    if (mAccumulator) {
-        static float throttle_accu = 0.f;
+        /* Map from unit circle to linear range and limit */
+        value = std::max(-1.0f, std::min(tanf(asinf(limited)), 1.0f));
+    }
 
-        throttle_accu += throttle * (40 / 1000.f);
-        throttle_accu = max(static_cast<float>(-1.f), min(throttle_accu, static_cast<float>(1.f)));
-        throttle = throttle_accu;
+    if (function == throttleFunction) {
+        if (s.throttleMode == ThrottleModeCenterZero && s.centerZeroSupport) {
+            if (!s.negativeThrust)
+                value = std::max(0.0f, value);
+        } else {
+            value = (value + 1.0f) / 2.0f;
+        }
+    } else if (s.exponential != 0) {
+        value = -s.exponential*powf(value,3) + (1+s.exponential) * value;
     }
 
-    if (mCircleCorrection) {
-        float roll_limited = std::max(static_cast<float>(-M_PI_4), std::min(roll, static_cast<float>(M_PI_4)));
-        float pitch_limited = std::max(static_cast<float>(-M_PI_4), std::min(pitch, static_cast<float>(M_PI_4)));
-        float yaw_limited = std::max(static_cast<float>(-M_PI_4), std::min(yaw, static_cast<float>(M_PI_4)));
-        float throttle_limited = std::max(static_cast<float>(-M_PI_4), std::min(throttle, static_cast<float>(M_PI_4)));
-        float wheel_limited = std::max(static_cast<float>(-M_PI_4), std::min(wheel, static_cast<float>(M_PI_4)));
+    return value;
+}
 
-        /* Map from unit circle to linear range and limit */
-        roll =      std::max(-1.0f, std::min(tanf(asinf(roll_limited)), 1.0f));
-        pitch =     std::max(-1.0f, std::min(tanf(asinf(pitch_limited)), 1.0f));
-        yaw =       std::max(-1.0f, std::min(tanf(asinf(yaw_limited)), 1.0f));
-        throttle =  std::max(-1.0f, std::min(tanf(asinf(throttle_limited)), 1.0f));
-        wheel =     std::max(-1.0f, std::min(tanf(asinf(wheel_limited)), 1.0f));
-    }
+/*
+ * Channel value of a shaped function value. The sticks are spread over
+ * MinChannelValue..MaxChannelValue around its middle, throttle from half
+ * of the range, the wheel is sent as 0..2000.
+ */
+float JoystickConfigManager::mapChannel(const Settings_t &s, int function, float value)
+{
+    float mid = s.minChannelValue + (s.maxChannelValue - s.minChannelValue) / 2;
+    float half = 1.0f;
 
-    if (mExponential != 0) {
-        roll =      -mExponential*powf(roll,3) + (1+mExponential) * roll;
-        pitch =     -mExponential*powf(pitch,3) + (1+mExponential) * pitch;
-        yaw =       -mExponential*powf(yaw,3) + (1+mExponential) * yaw;
-        wheel =     -mExponential*powf(wheel,3) + (1+mExponential) * wheel;
-    }
+    if (function == wheelFunction)
+        return DEFAULT_MID_CHANNEL_VALUE + value * DEFAULT_MID_CHANNEL_VALUE;
 
-    if (mThrottleMode == ThrottleModeCenterZero && mCenterZeroSupport) {
-        if (!mCenterZeroSupport || !mNegativeThrust) {
-            throttle = std::max(0.0f, throttle);
-        }
+    if (function == throttleFunction) {
+        half = 0.5f;
     } else {
-        throttle = (throttle + 1.0f) / 2.0f;
+        value += 1.0f;
     }
+    /* negative thrust has no room below the channel minimum */
+    value = std::max(0.0f, std::min(value, 2 * half));
 
-    controls->roll = roll;
-    controls->pitch = pitch;
-    controls->yaw = yaw;
-    controls->throttle = throttle;
-    controls->wheel = wheel;
+    if (value <= half)
+        return mid - (half - value) / half * (mid - s.minChannelValue);
+    return mid + (value - half) / half * (s.maxChannelValue - mid);
 }
 
-int JoystickConfigManager::getMinChannelValue()
+/*
+ * Sample the float pipeline once per lut point, so the input thread only
+ * interpolates between two neighbours. Every stage is continuous, the
+ * interpolation error stays below one channel step.
+ */
+void JoystickConfigManager::buildLut(Settings_t *s)
 {
-    return mMinChannelValue;
+    for (int function = 0; function < maxFunction; function++) {
+        for (int i = 0; i < JOYSTICK_LUT_POINTS; i++) {
+            int value = std::min((i << JOYSTICK_LUT_SHIFT) - 32768, 32767);
+            float channel = mapChannel(*s, function, shapeAxis(*s, function, normalizeAxis(*s, function, value)));
+
+            s->lut[function][i] = (int16_t)lrintf(channel * (1 << JOYSTICK_LUT_FRAC));
+        }
+    }
 }
 
-int JoystickConfigManager::getMaxChannelValue()
+void JoystickConfigManager::getChannelValues(uint16_t values[maxFunction], int steps)
 {
-    return mMaxChannelValue;
+    /* one snapshot for all axes, a reload can't mix two calibrations */
+    RcuPtr<Settings_t>::ReadGuard settings(mSettings);
+    const Settings_t &s = *settings;
+
+    for (int function = 0; function < maxFunction; function++) {
+        int value = mAxisValues[s.functionAxis[function]];
+        int32_t pos, frac;
+        const int16_t *lut = s.lut[function];
+
+        if (function == throttleFunction && s.accumulator) {
+            /* integrates over time, can't be tabulated */
+            mThrottleAccu += normalizeAxis(s, function, value) * (40 / 1000.f) * steps;
+            mThrottleAccu = std::max(-1.0f, std::min(mThrottleAccu, 1.0f));
+            values[function] = (uint16_t)mapChannel(s, function, shapeAxis(s, function, mThrottleAccu));
+            continue;
+        }
+
+        pos = std::max(-32768, std::min(value, 32767)) + 32768;
+        frac = pos & ((1 << JOYSTICK_LUT_SHIFT) - 1);
+        lut += pos >> JOYSTICK_LUT_SHIFT;
+        values[function] = (uint16_t)((lut[0] + (((lut[1] - lut[0]) * frac) >> JOYSTICK_LUT_SHIFT)) >> JOYSTICK_LUT_FRAC);
+    }
 }
 
 float JoystickConfigManager::getMessageFrequency()
 {
-    return mFrequency;
+    RcuPtr<Settings_t>::ReadGuard settings(mSettings);
+
+    return settings->frequency;
+}
+
+bool JoystickConfigManager::isValid()
+{
+    return mValid;
 }
 
 void JoystickConfigManager::reloadSettings()
@@ -147,56 +225,45 @@ void JoystickConfigManager::reloadSettings()
     loadSettings();
 }
 
-void JoystickConfigManager::loadSettings()
+bool JoystickConfigManager::loadSettings()
 {
-    mLoader->loadConfig(mFileName);
-
-    mLoader->beginSection("Basic");
-    mCalibrated = mLoader->getBool("calibrated");
-    mTransmitterMode = mLoader->getInt("transmitterMode", 2);
-    mLoader->endSection();
-
-    char section[30];
-    const char *str = "Axis%dCalibration";
-    for (int axis = 0; axis < mAxisCount; axis++) {
-        sprintf(section, str, axis);
-        mLoader->beginSection(section);
-        mCalibrations[axis].min = mLoader->getInt("AxisMin", -32768);
-        mCalibrations[axis].max = mLoader->getInt("AxisMax", 32767);
-        mCalibrations[axis].center = mLoader->getInt("AxisTrim");
-        mCalibrations[axis].deadband = mLoader->getInt("AxisDeadband");
-        mCalibrations[axis].reversed = mLoader->getBool("AxisRev");
-        mLoader->endSection();
+    ConfigSchema schema(mLoader, mFileName);
+    Settings_t *s = new Settings_t;
+    Settings_t &settings = *s;
+
+    if (!mLoader->loadConfig(mFileName))
+        ALOGW("Loading joystick config:%s failed, using defaults\n", mFileName.c_str());
+
+    schema.bind(sSettingsFields, sizeof(sSettingsFields) / sizeof(sSettingsFields[0]), &settings);
+    for (int axis = 0; axis < maxFunction; axis++) {
+        Calibration_t *c = &settings.calibrations[axis];
+
+        schema.bind(sCalibrationFields, sizeof(sCalibrationFields) / sizeof(sCalibrationFields[0]), c, NULL, axis);
+        if (c->min >= c->max || c->center < c->min || c->center > c->max)
+            schema.error("[Axis%dCalibration] needs AxisMin <= AxisTrim <= AxisMax, got %d, %d, %d",
+                         axis, c->min, c->center, c->max);
+    }
+    if (settings.minChannelValue >= settings.maxChannelValue)
+        schema.error("[FunctionChannel] MinChannelValue %d not below MaxChannelValue %d",
+                     settings.minChannelValue, settings.maxChannelValue);
+
+    /* a bad reload keeps the running settings */
+    if (!schema.report() && mValid) {
+        delete s;
+        return false;
     }
 
-    mLoader->beginSection("Function");
     for (int function = 0; function < maxFunction; function++) {
-        int axis = mLoader->getInt(sFunctionSettingsKey[function], function);
-        /* if function axis in config file is negative, use default values */
-        mFunctionAxis[function] = axis < 0 ? function : axis;
+        if (settings.functionAxis[function] < 0)
+            settings.functionAxis[function] = function;
     }
-    mLoader->endSection();
-    remapAxes(2, mTransmitterMode, mFunctionAxis);
-
-    mLoader->beginSection("FunctionChannel");
-    mFunctionChannels[rollFunction] = mLoader->getInt("RollChannel", 1);
-    mFunctionChannels[pitchFunction] = mLoader->getInt("PitchChannel", 2);
-    mFunctionChannels[yawFunction] = mLoader->getInt("YawChannel", 4);
-    mFunctionChannels[throttleFunction] = mLoader->getInt("ThrottleChannel", 3);
-    mMinChannelValue = mLoader->getInt("MinChannelValue", DEFAULT_MIN_CHANNEL_VALUE);
-    mMaxChannelValue = mLoader->getInt("MaxChannelValue", DEFAULT_MAX_CHANNEL_VALUE);
-    mLoader->endSection();
-
-    mLoader->beginSection("Additional");
-    mExponential = mLoader->getFloat("Exponential");
-    mAccumulator = mLoader->getBool("Accumulator");
-    mDeadband = mLoader->getBool("Deadband");
-    mCenterZeroSupport = mLoader->getBool("CenterZeroSupport", true);
-    mThrottleMode = (ThrottleMode_t)mLoader->getInt("ThrottleMode");
-    mNegativeThrust = mLoader->getBool("NegativeThrust");
-    mFrequency = mLoader->getFloat("Frequency", 25.0f);
-    mCircleCorrection = mLoader->getBool("CircleCorrection", true);
-    mLoader->endSection();
+    remapAxes(2, settings.transmitterMode, settings.functionAxis);
+    buildLut(s);
+
+    /* readers of the previous settings finish with them before they are freed */
+    mSettings.publish(s);
+
+    return schema.ok();
 }
 
 int JoystickConfigManager::mapFunctionMode(int mode, int function)
@@ -215,7 +282,7 @@ void JoystickConfigManager::remapAxes(int currentMode, int newMode, int (&newMap
     int temp[maxFunction];
 
     for (int function = 0; function < maxFunction; function++) {
-        temp[mapFunctionMode(newMode, function)] = mFunctionAxis[mapFunctionMode(currentMode, function)];
+        temp[mapFunctionMode(newMode, function)] = newMapping[mapFunctionMode(currentMode, function)];
     }
 
     for (int function = 0; function < maxFunction; function++) {
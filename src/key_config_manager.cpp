@@ -20,59 +20,113 @@
 
 #define SHORT_PRESS_POSTFIX "_short_press"
 #define LONG_PRESS_POSTFIX "_long_press"
-
-KeyConfigManager::KeyConfigManager(const string &filename, map<int, string> available_keys)
+/* keySettings entry of a key slot and press type */
+#define KEY_SETTING_INDEX(slot, longPress) ((slot) * 2 + ((longPress) ? 1 : 0))
+/* the ground unit sends sbus1 and sbus2 */
+#define KEY_SBUS_MAX 2
+#define DEFAULT_LONG_PRESS_MS 1000
+
+const ConfigField_t KeyConfigManager::sKeyFields[] = {
+    CONFIG_FIELD_INT(NULL, "sbus", KeySetting_t, sbus, 0, 0, KEY_SBUS_MAX),
+    CONFIG_FIELD_INT(NULL, "channel", KeySetting_t, channel, 0, 0, 16),
+    CONFIG_FIELD_INT(NULL, "value", KeySetting_t, value, 0, 0, 2047),
+    CONFIG_FIELD_INT(NULL, "switchType", KeySetting_t, switchType, TYPE_DEFAULT, TYPE_DEFAULT, TYPE_MAX - 1),
+    CONFIG_FIELD_INT(NULL, "defaultValue", KeySetting_t, defaultValue, 0, 0, 2047),
+};
+
+const ConfigField_t KeyConfigManager::sLongPressFields[] = {
+    CONFIG_FIELD_INT(NULL, "longPressMs", KeySetting_t, longPressMs, DEFAULT_LONG_PRESS_MS, 50, 10000),
+};
+
+const ConfigField_t KeyConfigManager::sScrollWheelFields[] = {
+    CONFIG_FIELD_INT("scrollwheel", "sbus", ScrollWheelSetting_t, sbus, 0, 0, KEY_SBUS_MAX),
+    CONFIG_FIELD_INT("scrollwheel", "channel", ScrollWheelSetting_t, channel, 0, 0, 16),
+};
+
+KeyConfigManager::KeyConfigManager(const string &filename, map<int, string> available_keys, MessageSender *sender)
     : mFileName(filename)
+    , mSender(sender)
     , mAvailableKeys(available_keys)
+    , mValid(false)
 {
     mKeyCount = mAvailableKeys.size();
     ALOGD("supported keys count : %d", mKeyCount);
     mKeyActionNames = new string[mKeyCount * 2];
+    for (int code = 0; code <= KEY_CODE_MAX; code++)
+        mKeySlots[code] = -1;
 
     map<int, string>::iterator it;
     int i;
     for (i = 0, it = mAvailableKeys.begin(); it != mAvailableKeys.end(); i++, it++) {
-        mKeyActionNames[i * 2] = it->second + SHORT_PRESS_POSTFIX;
-        mKeyActionNames[i * 2 + 1] = it->second + LONG_PRESS_POSTFIX;
-    }
-    for (int i = 0; i < mKeyCount * 2; i++) {
-        KeySetting_t key_setting;
-        memset(&key_setting, 0, sizeof(key_setting));
-        mKeySettingsMap.insert(make_pair(mKeyActionNames[i], key_setting));
+        mKeySlots[it->first] = i;
+        mKeyActionNames[KEY_SETTING_INDEX(i, false)] = it->second + SHORT_PRESS_POSTFIX;
+        mKeyActionNames[KEY_SETTING_INDEX(i, true)] = it->second + LONG_PRESS_POSTFIX;
     }
-
     mLoader = new ConfigLoader();
-    loadSettings();
+    mValid = loadSettings();
 }
 
 KeyConfigManager::~KeyConfigManager()
 {
-    delete mKeyActionNames;
+    delete[] mKeyActionNames;
     delete mLoader;
 }
 
-void KeyConfigManager::loadSettings()
+bool KeyConfigManager::loadSettings()
 {
-    if (mKeySettingsMap.empty()) {
-        return;
-    }
+    ConfigSchema schema(mLoader, mFileName);
+    Settings_t *settings = new Settings_t;
+    ScrollWheelSetting_t *scroll_wheel = &settings->scrollWheel;
 
-    mLoader->loadConfig(mFileName);
+    if (!mLoader->loadConfig(mFileName))
+        ALOGW("Loading key config:%s failed, using defaults\n", mFileName.c_str());
+
+    settings->keySettings.resize(mKeyCount * 2);
     for (int i = 0; i < mKeyCount * 2; i++) {
-        KeySetting_t *setting = &mKeySettingsMap[mKeyActionNames[i]];
-        mLoader->beginSection(mKeyActionNames[i]);
-        setting->sbus = mLoader->getInt("sbus");
-        setting->channel = mLoader->getInt("channel");
-        setting->value = mLoader->getInt("value");
-        setting->switchType = mLoader->getInt("switchType");
-        setting->defaultValue = mLoader->getInt("defaultValue");
-        mLoader->endSection();
+        KeySetting_t *setting = &settings->keySettings[i];
+
+        schema.bind(sKeyFields, sizeof(sKeyFields) / sizeof(sKeyFields[0]), setting, mKeyActionNames[i].c_str());
+        setting->longPressMs = DEFAULT_LONG_PRESS_MS;
+        /* odd entries are the long press sections, see KEY_SETTING_INDEX */
+        if (i & 1)
+            schema.bind(sLongPressFields, sizeof(sLongPressFields) / sizeof(sLongPressFields[0]), setting, mKeyActionNames[i].c_str());
+        /* a mapped channel is written to sbus stream sbus - 1 of the sender */
+        if (setting->channel != 0 && setting->sbus == 0)
+            schema.error("[%s] channel %d set without sbus", mKeyActionNames[i].c_str(), setting->channel);
     }
 
-    mLoader->beginSection("scrollwheel");
-    mScrollWheelSetting.sbus = mLoader->getInt("sbus");
-    mScrollWheelSetting.channel = mLoader->getInt("channel");
-    mLoader->endSection();
+    schema.bind(sScrollWheelFields, sizeof(sScrollWheelFields) / sizeof(sScrollWheelFields[0]), scroll_wheel);
+    if (scroll_wheel->sbus != 0 && scroll_wheel->channel == 0)
+        schema.error("[scrollwheel] sbus %d set without channel", scroll_wheel->sbus);
+
+    /* a bad reload keeps the running settings */
+    if (!schema.report() && mValid) {
+        delete settings;
+        return false;
+    }
+
+    /* readers of the previous settings finish with them before they are freed */
+    mSettings.publish(settings);
+
+    return schema.ok();
+}
+
+bool KeyConfigManager::isValid()
+{
+    return mValid;
+}
+
+int KeyConfigManager::getKeyCount()
+{
+    return mKeyCount;
+}
+
+int KeyConfigManager::getKeySlot(int keyCode)
+{
+    if (keyCode < 0 || keyCode > KEY_CODE_MAX)
+        return -1;
+
+    return mKeySlots[keyCode];
 }
 
 void KeyConfigManager::reloadSettings()
@@ -82,11 +136,12 @@ void KeyConfigManager::reloadSettings()
 
 map<int, int> KeyConfigManager::getSbusDefaultValues(int sbus)
 {
+    RcuPtr<Settings_t>::ReadGuard settings(mSettings);
     map<int, int> sbus_map;
     int channel;
 
     for (int i = 0; i < mKeyCount * 2; i++) {
-        KeySetting_t *setting = &mKeySettingsMap[mKeyActionNames[i]];
+        const KeySetting_t *setting = &settings->keySettings[i];
         if (sbus == setting->sbus) {
             channel = setting->channel;
             if (channel != 0) {
@@ -102,9 +157,10 @@ map<int, int> KeyConfigManager::getSbusDefaultValues(int sbus)
         }
     }
 
-    if (mScrollWheelSetting.sbus > 0 && mScrollWheelSetting.channel > 0) {
-        if (sbus == mScrollWheelSetting.sbus)
-            sbus_map[mScrollWheelSetting.channel] = 1000;
+    const ScrollWheelSetting_t &scroll_wheel = settings->scrollWheel;
+    if (scroll_wheel.sbus > 0 && scroll_wheel.channel > 0) {
+        if (sbus == scroll_wheel.sbus)
+            sbus_map[scroll_wheel.channel] = 1000;
     }
 
     return sbus_map;
@@ -112,13 +168,20 @@ map<int, int> KeyConfigManager::getSbusDefaultValues(int sbus)
 
 bool KeyConfigManager::getChannelValue(int keyCode, KeyAction_t action, int* sbus, int* channel, int* value)
 {
-    string key_action = getKeyActionStr(keyCode, action);
+    int slot = getKeySlot(keyCode);
+    KeySetting_t setting;
 
-    if (mKeySettingsMap.find(key_action) == mKeySettingsMap.end()) {
+    if (slot < 0) {
         return false;
     }
 
-    KeySetting_t setting = mKeySettingsMap[key_action];
+    {
+        RcuPtr<Settings_t>::ReadGuard settings(mSettings);
+
+        /* to check hold mode setting, just use the setting for short */
+        setting = settings->keySettings[KEY_SETTING_INDEX(slot, action == KeyAction_LongPress)];
+    }
+
     if (setting.switchType != TYPE_MOMENTARY && (action == KeyAction_Down || action == KeyAction_Up)) {
         return false;
     }
@@ -149,33 +212,26 @@ bool KeyConfigManager::getChannelValue(int keyCode, KeyAction_t action, int* sbu
 
 bool KeyConfigManager::getScrollWheelSetting(int *sbus, int *channel)
 {
-    *sbus = mScrollWheelSetting.sbus;
-    *channel = mScrollWheelSetting.channel;
+    RcuPtr<Settings_t>::ReadGuard settings(mSettings);
+
+    *sbus = settings->scrollWheel.sbus;
+    *channel = settings->scrollWheel.channel;
 
     return (*sbus != 0);
 }
 
-string KeyConfigManager::getKeyActionStr(int keyCode, int action)
+int KeyConfigManager::getLongPressMs(int keyCode)
 {
-    if (mAvailableKeys.find(keyCode) == mAvailableKeys.end()) {
-        return "";
-    }
+    RcuPtr<Settings_t>::ReadGuard settings(mSettings);
+    int slot = getKeySlot(keyCode);
 
-    string key_action = mAvailableKeys[keyCode];
-    /* to check hold mode setting, just use the setting for short */
-    if (action == KeyAction_Down || action == KeyAction_Up) {
-        action = 0;
-    }
-    if (action == 0) {
-        key_action += SHORT_PRESS_POSTFIX;
-    } else if (action == 1) {
-        key_action += LONG_PRESS_POSTFIX;
-    }
+    if (slot < 0)
+        return DEFAULT_LONG_PRESS_MS;
 
-    return key_action;
+    return settings->keySettings[KEY_SETTING_INDEX(slot, true)].longPressMs;
 }
 
 int KeyConfigManager::currentChannelValue(int sbus, int channel)
 {
-    return MessageSender::getChannelValue(sbus, channel);
+    return mSender->getChannelValue(sbus, channel);
 }
@@ -16,6 +16,7 @@
 
 #include "service.h"
 #include "config_loader.h"
+#include "sbus_codec.h"
 
 int main(int argc, char *argv[])
 {
@@ -37,6 +38,8 @@ int main(int argc, char *argv[])
     strncpy(unit_type, config_loader.getStr("UnitType", "").c_str(), 3);
     config_loader.endSection();
 
+    sbus_codec_init();
+
     if (!strncmp("air", unit_type, 3)) {
         ALOGI("starting air rc service\n");
         ret = air_main(argc - 1, &argv[1]);
@@ -14,15 +14,45 @@
  * limitations under the License.
  */
 
+#include <algorithm>
+#include <poll.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include "message_sender.h"
 #include "rc_utils.h"
 
-uint16_t MessageSender::mChannelValues[2][16] = { {0}, {0} };
+#define NSEC_PER_SEC 1000000000LL
+#define STATS_INTERVAL_NS (10 * NSEC_PER_SEC)
+#define DEFAULT_FREQUENCY 25.0f
+/* send failures are logged at most once per interval */
+#define ERROR_LOG_INTERVAL_NS NSEC_PER_SEC
 
-MessageSender::MessageSender(int sbusNum)
-    : mSendSbusNum(sbusNum)
+MessageSender::MessageSender(int sbusNum, int msgVersion)
+    : mSocketFd(-1)
+    , mFrequency(DEFAULT_FREQUENCY)
+    , mSendSbusNum(sbusNum)
+    , mMsgVersion(msgVersion)
+    , mSendErrors(0)
+    , mLastErrorLogNs(0)
+    , mLoggedErrors(0)
+    , mSendMode(SEND_PERIODIC)
+    , mMinGapNs(0)
+    , mWakeFd(-1)
+    , mTimerFd(-1)
+    , mPackedVersion(0)
+    , mLastSendNs(0)
+    , mLastStatsNs(0)
+    , mIntervalSumNs(0)
+    , mIntervalCount(0)
+    , mPendingChanged(false)
 {
     bzero(&mSockaddr, sizeof(mSockaddr));
+    for (int i = 0; i < SBUS_MAX_PORTS; i++)
+        mSeq[i] = 0;
+    memset(&mStats, 0, sizeof(mStats));
+    memset(&mPendingFrame, 0, sizeof(mPendingFrame));
+    pthread_mutex_init(&mUpdateLock, NULL);
 }
 
 MessageSender::~MessageSender()
@@ -30,6 +60,11 @@ MessageSender::~MessageSender()
     if (mSocketFd > -1) {
         close(mSocketFd);
     }
+    if (mWakeFd >= 0)
+        close(mWakeFd);
+    if (mTimerFd >= 0)
+        close(mTimerFd);
+    pthread_mutex_destroy(&mUpdateLock);
 }
 
 int MessageSender::openSocket(const char *ip, unsigned long port)
@@ -43,100 +78,366 @@ int MessageSender::openSocket(const char *ip, unsigned long port)
     mSockaddr.sin_addr.s_addr = inet_addr(ip);
     mSockaddr.sin_port = htons(port);
 
+    /* the route is looked up once here instead of on every datagram */
+    if (connect(mSocketFd, (struct sockaddr *)&mSockaddr, sizeof(mSockaddr)) < 0) {
+        ALOGE("Could not connect rc socket to %s:%lu: %s", ip, port, strerror(errno));
+        close(mSocketFd);
+        mSocketFd = -1;
+        return -1;
+    }
+
     return mSocketFd;
 }
 
+void MessageSender::setSendMode(SendMode mode, float maxFrequency)
+{
+    mSendMode = mode;
+    mMinGapNs = (int64_t)(NSEC_PER_SEC / maxFrequency);
+    /* created before any writer runs, commitUpdate() reads it unlocked */
+    if (mSendMode == SEND_ON_CHANGE && mWakeFd < 0) {
+        mWakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (mWakeFd < 0) {
+            ALOGE("Could not create send eventfd: %s, sending periodically", strerror(errno));
+            mSendMode = SEND_PERIODIC;
+        }
+    }
+}
+
 void MessageSender::startThread()
 {
     pthread_t thread;
 
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (mTimerFd < 0) {
+        ALOGE("Could not create send timerfd: %s", strerror(errno));
+        return;
+    }
+
     if (pthread_create(&thread, NULL, threadLoop, (void *)this)) {
         ALOGE("Failed to create thread to send sbus mesage.");
         return;
     }
 }
 
+int64_t MessageSender::periodNs()
+{
+    float freq = mFrequency;
+
+    if (!(freq > 0))
+        freq = DEFAULT_FREQUENCY;
+
+    return (int64_t)(NSEC_PER_SEC / freq);
+}
+
 void *MessageSender::threadLoop(void *arg)
 {
     MessageSender *sender = (MessageSender *)arg;
 
+    sender->run();
+
+    return NULL;
+}
+
+/*
+ * Rounds run on absolute CLOCK_MONOTONIC deadlines, so neither the send
+ * time nor the timer granularity adds up to drift. A periodic round that
+ * starts so late that its next deadline has passed too doesn't catch up
+ * with a burst, every passed deadline is skipped and counted as an overrun.
+ *
+ * In SEND_ON_CHANGE a committed change wakes the loop through mWakeFd and
+ * goes out at once, or as soon as the minimum gap to the previous round
+ * has passed. The period then only paces heartbeats, counted from the
+ * last round of any kind.
+ */
+void MessageSender::run()
+{
+    struct pollfd fds[2];
+    struct itimerspec spec;
+    int64_t heartbeat, target, period, now, next;
+    uint64_t count;
+    bool changed = false;
+    int nfds = 1;
+
+    fds[0].fd = mTimerFd;
+    fds[0].events = POLLIN;
+    if (mWakeFd >= 0) {
+        fds[1].fd = mWakeFd;
+        fds[1].events = POLLIN;
+        nfds = 2;
+    }
+
+    heartbeat = target = monotonic_ns();
     while (1) {
-        sender->sendMessage();
+        now = monotonic_ns();
+        if (now >= heartbeat || (changed && now - mLastSendNs >= mMinGapNs)) {
+            bool change = now < heartbeat;
+
+            sendRound();
+            recordRound(now, now > target ? now - target : 0, change);
+            changed = false;
+
+            /* a new frequency starts with the next period */
+            period = periodNs();
+            if (mSendMode == SEND_ON_CHANGE) {
+                heartbeat = now + period;
+            } else {
+                heartbeat += period;
+                /* next deadline already passed: skip to one in the future */
+                if (now >= heartbeat) {
+                    int64_t missed = (now - heartbeat) / period + 1;
+
+                    mStats.overruns += missed;
+                    heartbeat += missed * period;
+                }
+            }
+            continue;
+        }
+
+        next = heartbeat;
+        if (changed && mLastSendNs + mMinGapNs < next)
+            next = mLastSendNs + mMinGapNs;
+        target = next;
+
+        memset(&spec, 0, sizeof(spec));
+        ns_to_timespec(next, &spec.it_value);
+        if (timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+            ALOGE("Could not arm send timer: %s", strerror(errno));
 
-        int mswait = (int)(1000.0f / sender->mFrequency);
-        usleep(mswait * 1000);
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno != EINTR)
+                ALOGE("send thread poll failed: %s", strerror(errno));
+            continue;
+        }
+        if (fds[0].revents & POLLIN)
+            read(mTimerFd, &count, sizeof(count));
+        if (nfds > 1 && (fds[1].revents & POLLIN) && read(mWakeFd, &count, sizeof(count)) == sizeof(count)) {
+            changed = true;
+            /* a change is due at once, or when the minimum gap has passed */
+            target = std::max(monotonic_ns(), mLastSendNs + mMinGapNs);
+        }
     }
 }
 
-int MessageSender::sendMessage()
+/* both frames of one channel snapshot, packed again only after a change */
+void MessageSender::sendRound()
 {
-    int ret;
-    struct rc_msg msg;
-    memset(&msg, 0, sizeof(struct rc_msg));
+    ChannelFrame_t frame;
+    uint32_t version;
 
-    for (int i = 0; i < mSendSbusNum; i++) {
-        pack_rc_msg(i, mChannelValues[i], &msg);
+    version = getChannelFrame(&frame);
+    if (version != mPackedVersion || !mPackedVersion) {
+        memset(mPackedMsgs, 0, sizeof(mPackedMsgs));
+        for (int i = 0; i < mSendSbusNum; i++)
+            pack_rc_msg(i, frame.values[i], &mPackedMsgs[i]);
+        mPackedVersion = version;
+    }
 
-        ret = sendto(mSocketFd, &msg, sizeof(msg), 0, (struct sockaddr *)&mSockaddr, sizeof(mSockaddr));
-        if (ret < 0) {
-            ALOGE("Could not send rc message to air side: %s", strerror(errno));
-        }
+    sendMessages(mPackedMsgs, mSendSbusNum);
+}
+
+void MessageSender::recordRound(int64_t now, int64_t lateNs, bool change)
+{
+    if (mLastSendNs) {
+        int64_t interval = now - mLastSendNs;
+
+        if (!mStats.minIntervalNs || interval < mStats.minIntervalNs)
+            mStats.minIntervalNs = interval;
+        if (interval > mStats.maxIntervalNs)
+            mStats.maxIntervalNs = interval;
+        mIntervalSumNs += interval;
+        mIntervalCount++;
+    } else {
+        mLastStatsNs = now;
     }
+    if (lateNs > mStats.maxLateNs)
+        mStats.maxLateNs = lateNs;
+    mStats.rounds++;
+    if (change)
+        mStats.changeRounds++;
+    mLastSendNs = now;
+
+    if (now - mLastStatsNs < STATS_INTERVAL_NS)
+        return;
+
+    mStats.periodNs = periodNs();
+    if (mIntervalCount)
+        mStats.avgIntervalNs = mIntervalSumNs / mIntervalCount;
+    mLastStats.write(mStats);
+    ALOGI("rc send period:%lldus, rounds:%llu, change rounds:%llu, overruns:%llu, interval min:%lldus avg:%lldus max:%lldus, max late:%lldus",
+          (long long)(mStats.periodNs / 1000), (unsigned long long)mStats.rounds,
+          (unsigned long long)mStats.changeRounds,
+          (unsigned long long)mStats.overruns, (long long)(mStats.minIntervalNs / 1000),
+          (long long)(mStats.avgIntervalNs / 1000), (long long)(mStats.maxIntervalNs / 1000),
+          (long long)(mStats.maxLateNs / 1000));
 
-    return 0;
+    /* the interval to the last round of this window opens the next one */
+    memset(&mStats, 0, sizeof(mStats));
+    mIntervalSumNs = 0;
+    mIntervalCount = 0;
+    mLastStatsNs = now;
+}
+
+void MessageSender::getSendStats(SendStats_t *stats)
+{
+    if (!mLastStats.read(stats))
+        memset(stats, 0, sizeof(*stats));
+}
+
+int MessageSender::sendMessage()
+{
+    return sendMessages((1u << mSendSbusNum) - 1);
 }
 
 int MessageSender::sendMessage(int sbus)
 {
-    int ret;
-    struct rc_msg msg;
-    memset(&msg, 0, sizeof(struct rc_msg));
+    return sendMessages(1u << sbus);
+}
 
-    pack_rc_msg(sbus, mChannelValues[sbus], &msg);
+int MessageSender::sendMessages(uint32_t sbusMask)
+{
+    struct rc_msg msgs[2];
+    ChannelFrame_t frame;
+    int count = 0;
 
-    ret = sendto(mSocketFd, &msg, sizeof(msg), 0, (struct sockaddr *)&mSockaddr, sizeof(mSockaddr));
-    if (ret < 0) {
-        ALOGE("Could not send rc message to air side: %s", strerror(errno));
+    memset(msgs, 0, sizeof(msgs));
+    /* all streams of a call come from the same snapshot */
+    getChannelFrame(&frame);
+    for (int i = 0; i < 2; i++) {
+        if (sbusMask & (1u << i))
+            pack_rc_msg(i, frame.values[i], &msgs[count++]);
     }
 
-    return ret;
+    return sendMessages(msgs, count);
 }
 
 int MessageSender::sendMessage(int sbus, uint8_t (&data)[25])
 {
-    int ret;
     struct rc_msg msg;
     memset(&msg, 0, sizeof(struct rc_msg));
 
     msg.type_idex = (sbus & CHANNEL_IDEX) | SBUS_MODE;
     memcpy(msg.rc_data, data, sizeof(data));
 
-    ret = sendto(mSocketFd, &msg, sizeof(msg), 0, (struct sockaddr *)&mSockaddr, sizeof(mSockaddr));
-    if (ret < 0) {
-        ALOGE("Could not send rc message to air side: %s", strerror(errno));
+    return sendMessage(&msg);
+}
+
+int MessageSender::sendMessage(struct rc_msg *msg)
+{
+    return sendMessages(msg, 1);
+}
+
+int MessageSender::sendMessages(const struct rc_msg *msgs, int count)
+{
+    struct rc_msg_v2 msgs_v2[SBUS_MAX_PORTS];
+    struct mmsghdr hdrs[SBUS_MAX_PORTS];
+    struct iovec iovs[SBUS_MAX_PORTS];
+    uint32_t now_us = (uint32_t)(monotonic_ns() / 1000);
+    int sent = 0, failed = 0, ret;
+
+    if (count > SBUS_MAX_PORTS)
+        count = SBUS_MAX_PORTS;
+
+    memset(hdrs, 0, sizeof(hdrs[0]) * count);
+    for (int i = 0; i < count; i++) {
+        if (mMsgVersion == 2) {
+            uint32_t seq = mSeq[msgs[i].type_idex & CHANNEL_IDEX]++;
+            pack_rc_msg_v2(&msgs[i], seq, now_us, &msgs_v2[i]);
+            iovs[i].iov_base = &msgs_v2[i];
+            iovs[i].iov_len = sizeof(msgs_v2[i]);
+        } else {
+            iovs[i].iov_base = (void *)&msgs[i];
+            iovs[i].iov_len = sizeof(msgs[i]);
+        }
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
     }
 
-    return ret;
+    /* the socket is connected, no address per datagram */
+    while (sent < count) {
+        ret = sendmmsg(mSocketFd, hdrs + sent, count - sent, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            /* the failed datagram is dropped, the rest still get a try */
+            reportSendError(errno, 1);
+            failed++;
+            sent++;
+            continue;
+        }
+        sent += ret;
+    }
+
+    return (count && failed == count) ? -1 : count - failed;
 }
 
-int MessageSender::sendMessage(struct rc_msg *msg)
+/*
+ * A missing air unit fails every datagram, so errors are counted and
+ * logged at most once per ERROR_LOG_INTERVAL_NS with the count since the
+ * previous log.
+ */
+void MessageSender::reportSendError(int err, int lost)
+{
+    uint64_t errors = mSendErrors.fetch_add(lost) + lost;
+    int64_t now = monotonic_ns();
+    int64_t last = mLastErrorLogNs.load();
+
+    if (last && now - last < ERROR_LOG_INTERVAL_NS)
+        return;
+    /* only one sender thread logs per interval */
+    if (!mLastErrorLogNs.compare_exchange_strong(last, now))
+        return;
+
+    ALOGE("Could not send rc message to air side: %s, %llu failed since last report, %llu total",
+          strerror(err), (unsigned long long)(errors - mLoggedErrors.exchange(errors)),
+          (unsigned long long)errors);
+}
+
+void MessageSender::beginUpdate()
 {
-    int ret;
+    pthread_mutex_lock(&mUpdateLock);
+}
 
-    ret = sendto(mSocketFd, msg, sizeof(struct rc_msg), 0, (struct sockaddr *)&mSockaddr, sizeof(mSockaddr));
-    if (ret < 0) {
-        ALOGE("Could not send rc message to air side: %s", strerror(errno));
+void MessageSender::updateChannelValue(int sbus, int ch, uint16_t value)
+{
+    uint16_t *slot = &mPendingFrame.values[sbus - 1][ch - 1];
+
+    if (*slot != value) {
+        *slot = value;
+        mPendingChanged = true;
     }
+}
 
-    return ret;
+void MessageSender::commitUpdate()
+{
+    uint64_t one = 1;
+
+    /* an unchanged frame keeps its version */
+    if (mPendingChanged) {
+        mChannels.write(mPendingFrame);
+        mPendingChanged = false;
+        if (mWakeFd >= 0 && write(mWakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            ALOGE("Could not wake send thread: %s", strerror(errno));
+    }
+    pthread_mutex_unlock(&mUpdateLock);
 }
 
 void MessageSender::setChannelValue(int sbus, int ch, uint16_t value)
 {
-    mChannelValues[sbus - 1][ch - 1] = value;
+    beginUpdate();
+    updateChannelValue(sbus, ch, value);
+    commitUpdate();
 }
 
 int MessageSender::getChannelValue(int sbus, int ch)
 {
-    return mChannelValues[sbus - 1][ch - 1];
+    ChannelFrame_t frame;
+
+    getChannelFrame(&frame);
+
+    return frame.values[sbus - 1][ch - 1];
+}
+
+uint32_t MessageSender::getChannelFrame(ChannelFrame_t *frame)
+{
+    return mChannels.read(frame);
 }
@@ -14,13 +14,18 @@
  * limitations under the License.
  */
 
+#include <charconv>
+#include <ctype.h>
+#include <endian.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stddef.h>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
 #include "service.h"
 #include "rc_utils.h"
+#include "sbus_codec.h"
 
 #define SCALE_OFFSET 874
 #define SCALE_FACTOR 0.625
@@ -102,13 +107,13 @@ failed:
     return -ENXIO;
 }
 
-int add_epoll_fd(int epoll_fd, int device_fd, epoll_data_t data)
+int add_epoll_fd(int epoll_fd, int device_fd, epoll_data_t data, uint32_t events)
 {
     int ret = 0;
     struct epoll_event event;
     memset(&event, 0, sizeof(event));
 
-    event.events = EPOLLIN;
+    event.events = events;
     event.data = data;
 
     ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, device_fd, &event);
@@ -163,87 +168,124 @@ bool getValue(const string &filename, int *value)
     return true;
 }
 
+int sysfs_attr_open(const char *path, int flags)
+{
+    int fd = open(path, flags | O_CLOEXEC);
+
+    if (fd < 0)
+        ALOGE("open %s failed error=%s\n", path, strerror(errno));
+
+    return fd;
+}
+
+/*
+ * Write a value to a sysfs attribute kept open by the caller, without
+ * any allocation. sysfs parses each write from offset 0.
+ */
+bool sysfs_attr_write(int fd, int value)
+{
+    char buf[16];
+    char *p = buf + sizeof(buf);
+    unsigned int v = value < 0 ? -(unsigned int)value : value;
+
+    if (fd < 0)
+        return false;
+
+    *--p = '\n';
+    do {
+        *--p = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    if (value < 0)
+        *--p = '-';
+
+    if (pwrite(fd, p, buf + sizeof(buf) - p, 0) < 0) {
+        ALOGE("write sysfs fd %d failed error=%s\n", fd, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Read up to count whitespace separated integers from a sysfs attribute
+ * kept open by the caller. sysfs regenerates the text on each read from
+ * offset 0, so no seek and no stream is needed. Returns the number of
+ * values parsed, or -1 if the read failed.
+ */
+int sysfs_attr_read(int fd, int *values, int count)
+{
+    char buf[128];
+    const char *p = buf, *end;
+    ssize_t len;
+    int n = 0;
+
+    if (fd < 0)
+        return -1;
+
+    len = pread(fd, buf, sizeof(buf), 0);
+    if (len < 0) {
+        ALOGE("read sysfs fd %d failed error=%s\n", fd, strerror(errno));
+        return -1;
+    }
+    end = buf + len;
+
+    while (n < count) {
+        while (p < end && isspace((unsigned char)*p))
+            p++;
+        std::from_chars_result res = std::from_chars(p, end, values[n]);
+        if (res.ec != std::errc())
+            break;
+        p = res.ptr;
+        n++;
+    }
+
+    return n;
+}
+
 void pack_rc_msg(int sbus, uint16_t (&channels)[16], struct rc_msg *msg)
 {
     msg->type_idex = (sbus & CHANNEL_IDEX) | SBUS_MODE;
     /* sbus protocol start byte:0xF0 */
     msg->rc_data[0] = SBUS_STARTBYTE;
-    /* sbus protocol data1: channel1 0-7 bit */
-    msg->rc_data[1] =(channels[0] & 0xff);
-    /* sbus protocol data2: channel1 8-10 bit and channel2 0-4 */
-    msg->rc_data[2] =(((channels[0] >> 8) | (channels[1]<< 3)) & 0xff);
-    /* sbus protocol data3: channel2 5-10 bit and channel3 0-1 */
-    msg->rc_data[3] =(((channels[1] >> 5) | (channels[2] << 6)) & 0xff);
-    /* sbus protocol data4: channel3 2-9 bit */
-    msg->rc_data[4] =((channels[2] >> 2) & 0xff);
-    /* sbus protocol data5: channel3 10 bit and channel4 0-6 */
-    msg->rc_data[5] =(((channels[2] >> 10) | (channels[3] << 1)) & 0xff);
-    /* sbus protocol data6: channel4 7-10 bit and channel5 0-3 */
-    msg->rc_data[6] =(((channels[3] >> 7) | (channels[4] << 4)) & 0xff);
-    /* sbus protocol data7: channel5 4-10 bit and channel6 0 */
-    msg->rc_data[7] =(((channels[4] >> 4) | (channels[5] << 7)) & 0xff);
-    /* sbus protocol data8: channel6 1-8 bit */
-    msg->rc_data[8] =((channels[5] >> 1) & 0xff);
-    /* sbus protocol data9: channel6 9-10 bit and channel7 0-5 */
-    msg->rc_data[9] =(((channels[5] >> 9) | (channels[6] << 2)) & 0xff);
-    /* sbus protocol data10: channel7 6-10 bit and channel8 0-2 */
-    msg->rc_data[10] =(((channels[6] >> 6) | (channels[7] << 5)) & 0xff);
-    /* sbus protocol data11: channel8 3-10 bit */
-    msg->rc_data[11] =(((channels[7] >> 3)) & 0xff);
-
-    /* sbus protocol data12: channel9 0-7 bit */
-    msg->rc_data[12] =(channels[8] & 0xff);
-    /* sbus protocol data13: channel9 8-10 bit and channel10 0-4 */
-    msg->rc_data[13] =(((channels[8] >> 8) | (channels[9] << 3)) & 0xff);
-    /* sbus protocol data14: channel10 5-10 bit and channel11 0-1 */
-    msg->rc_data[14] =(((channels[9] >> 5) | (channels[10] << 6)) & 0xff);
-    /* sbus protocol data15: channel11 2-9 bit */
-    msg->rc_data[15] =((channels[10] >> 2) & 0xff);
-    /* sbus protocol data16: channel11 10 bit and channel12 0-6 */
-    msg->rc_data[16] =(((channels[10] >> 10) | (channels[11] << 1)) & 0xff);
-    /* sbus protocol data17: channel12 7-10 bit and channel13 0-3 */
-    msg->rc_data[17] =(((channels[11] >> 7) | (channels[12] << 4)) & 0xff);
-    /* sbus protocol data18: channel13 4-10 bit and channel14 0 */
-    msg->rc_data[18] =(((channels[12] >> 4) | (channels[13] << 7)) & 0xff);
-    /* sbus protocol data19: channel14 1-8 bit */
-    msg->rc_data[19] =((channels[13] >> 1) & 0xff);
-    /* sbus protocol data20: channel14 9-10 bit and channel15 0-5 */
-    msg->rc_data[20] =(((channels[13] >> 9) | (channels[14] << 2)) & 0xff);
-    /* sbus protocol data21: channel15 6-10 bit and channel16 0-2 */
-    msg->rc_data[21] =(((channels[14] >> 6) | (channels[15] << 5)) & 0xff);
-    /* sbus protocol data22: channel16 3-10 bit */
-    msg->rc_data[22] =((channels[15] >> 3) & 0xff);
-
+    /* sbus protocol data1-22: 16 channels of 11 bit */
+    sbus_pack(channels, msg->rc_data + 1);
+    /* sbus protocol flags */
     msg->rc_data[23] = 0x00;
     msg->rc_data[24] = SBUS_ENDBYTE;
 }
 
+void pack_rc_msg_v2(const struct rc_msg *msg, uint32_t seq, uint32_t send_time_us, struct rc_msg_v2 *msg_v2)
+{
+    memset(msg_v2, 0, sizeof(struct rc_msg_v2));
+    msg_v2->type_idex = msg->type_idex | RC_MSG_V2;
+    msg_v2->seq = htole32(seq);
+    msg_v2->send_time_us = htole32(send_time_us);
+    memcpy(msg_v2->rc_data, msg->rc_data, SBUS_DATA_LEN);
+    msg_v2->crc = htole16(crc16_sum((uint8_t *)msg_v2, offsetof(struct rc_msg_v2, crc)));
+}
+
+bool unpack_rc_msg_v2(const struct rc_msg_v2 *msg_v2, struct rc_msg *msg, uint32_t *seq, uint32_t *send_time_us)
+{
+    if (!(msg_v2->type_idex & RC_MSG_V2))
+        return false;
+
+    if (le16toh(msg_v2->crc) != crc16_sum((uint8_t *)msg_v2, offsetof(struct rc_msg_v2, crc)))
+        return false;
+
+    msg->type_idex = msg_v2->type_idex & ~RC_MSG_V2;
+    memcpy(msg->rc_data, msg_v2->rc_data, SBUS_DATA_LEN);
+    *seq = le32toh(msg_v2->seq);
+    *send_time_us = le32toh(msg_v2->send_time_us);
+
+    return true;
+}
+
 void debug_sbus_data(int index, uint8_t *s)
 {
     uint16_t channel_data[16];
-    uint16_t *d = channel_data;
-
-#define F(v, s) (((v) >> (s)) & 0x7ff)
-
-    /* unroll channels 1-8 */
-    *d++ = F(s[0] | s[1] << 8, 0);
-    *d++ = F(s[1] | s[2] << 8, 3);
-    *d++ = F(s[2] | s[3] << 8 | s[4] << 16, 6);
-    *d++ = F(s[4] | s[5] << 8, 1);
-    *d++ = F(s[5] | s[6] << 8, 4);
-    *d++ = F(s[6] | s[7] << 8 | s[8] << 16, 7);
-    *d++ = F(s[8] | s[9] << 8, 2);
-    *d++ = F(s[9] | s[10] << 8, 5);
-
-    /* unroll channels 9-16 */
-    *d++ = F(s[11] | s[12] << 8, 0);
-    *d++ = F(s[12] | s[13] << 8, 3);
-    *d++ = F(s[13] | s[14] << 8 | s[15] << 16, 6);
-    *d++ = F(s[15] | s[16] << 8, 1);
-    *d++ = F(s[16] | s[17] << 8, 4);
-    *d++ = F(s[17] | s[18] << 8 | s[19] << 16, 7);
-    *d++ = F(s[19] | s[20] << 8, 2);
-    *d++ = F(s[20] | s[21] << 8, 5);
+
+    sbus_unpack(s, channel_data);
 
     std::ostringstream log;
     for (int i = 0; i < 16; i++) {
@@ -258,9 +300,9 @@ void debug_sbus_data(int index, uint8_t *s)
  */
 void debug_sbus_data_interval(int index, uint8_t *s, int interval)
 {
-    static int count[2] = { 0, 0 };
+    static int count[SBUS_MAX_PORTS];
 
-    if (index >= 2) {
+    if (index < 0 || index >= SBUS_MAX_PORTS) {
         ALOGE("%s : uncorrect sbus index %d", __func__, index);
         return;
     }
@@ -284,7 +326,8 @@ int ppm_to_sbus(int ppm)
     if (ppm >= 800 && ppm <= 874) {
         sbus = 0;
     } else if (ppm >= 875 && ppm <= 2152) {
-        sbus = ceil((ppm - SCALE_OFFSET - 0.5f) / SCALE_FACTOR);
+        /* ceil((ppm - SCALE_OFFSET - 0.5) / SCALE_FACTOR), SCALE_FACTOR is 10/16 */
+        sbus = (16 * (ppm - SCALE_OFFSET) + 1) / 10;
     } else if (ppm >= 2153 && ppm <= 2200) {
         sbus = 2047;
     }
@@ -337,3 +380,18 @@ uint8_t bcc_sum(uint8_t data[], size_t size)
 
     return sum;
 }
+
+int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void ns_to_timespec(int64_t ns, struct timespec *ts)
+{
+    ts->tv_sec = ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <utils/Log.h>
+#include "sbus_codec.h"
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define SBUS_CODEC_NEON
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SBUS_CODEC_AVX2
+#ifdef __SSE2__
+#define SBUS_CODEC_SSE2
+#endif
+#endif
+
+#define SBUS_CHANNEL_MASK 0x7ff
+/* payload copy with room for the widest vector load */
+#define SBUS_PAD_LEN 32
+#define SBUS_CHECK_FRAMES 256
+
+typedef void (*sbus_unpack_fn)(const uint8_t *payload, uint16_t *channels);
+
+/*
+ * Byte offset and bit shift of every channel in the payload. Each
+ * channel spans at most three bytes.
+ */
+static const struct {
+    uint8_t offset;
+    uint8_t shift;
+} sChannelLayout[SBUS_CHANNELS] = {
+    {  0, 0 }, {  1, 3 }, {  2, 6 }, {  4, 1 }, {  5, 4 }, {  6, 7 }, {  8, 2 }, {  9, 5 },
+    { 11, 0 }, { 12, 3 }, { 13, 6 }, { 15, 1 }, { 16, 4 }, { 17, 7 }, { 19, 2 }, { 20, 5 },
+};
+
+static void unpack_scalar(const uint8_t *payload, uint16_t *channels)
+{
+    uint8_t p[SBUS_PAD_LEN] = { 0 };
+    uint32_t v;
+
+    memcpy(p, payload, SBUS_PAYLOAD_LEN);
+
+    for (int i = 0; i < SBUS_CHANNELS; i++) {
+        const uint8_t *s = p + sChannelLayout[i].offset;
+        v = s[0] | s[1] << 8 | s[2] << 16;
+        channels[i] = (v >> sChannelLayout[i].shift) & SBUS_CHANNEL_MASK;
+    }
+}
+
+#ifdef SBUS_CODEC_NEON
+/*
+ * Each group of 8 channels takes 11 bytes. A table lookup gathers the
+ * three bytes of 4 channels into 32 bit lanes, then a per lane shift
+ * and mask extracts the values.
+ */
+static void unpack_neon(const uint8_t *payload, uint16_t *channels)
+{
+    static const uint8_t idx_lo[16] = { 0, 1, 2, 0xff, 1, 2, 3, 0xff, 2, 3, 4, 0xff, 4, 5, 6, 0xff };
+    static const uint8_t idx_hi[16] = { 5, 6, 7, 0xff, 6, 7, 8, 0xff, 8, 9, 10, 0xff, 9, 10, 11, 0xff };
+    static const int32_t shift_lo[4] = { 0, -3, -6, -1 };
+    static const int32_t shift_hi[4] = { -4, -7, -2, -5 };
+    uint8_t p[SBUS_PAD_LEN] = { 0 };
+    uint8x16_t ilo = vld1q_u8(idx_lo), ihi = vld1q_u8(idx_hi);
+    int32x4_t slo = vld1q_s32(shift_lo), shi = vld1q_s32(shift_hi);
+    uint32x4_t mask = vdupq_n_u32(SBUS_CHANNEL_MASK);
+
+    memcpy(p, payload, SBUS_PAYLOAD_LEN);
+
+    for (int g = 0; g < 2; g++) {
+        uint8x16_t src = vld1q_u8(p + g * 11);
+        uint32x4_t lo = vreinterpretq_u32_u8(vqtbl1q_u8(src, ilo));
+        uint32x4_t hi = vreinterpretq_u32_u8(vqtbl1q_u8(src, ihi));
+
+        lo = vandq_u32(vshlq_u32(lo, slo), mask);
+        hi = vandq_u32(vshlq_u32(hi, shi), mask);
+        vst1q_u16(channels + g * 8, vcombine_u16(vmovn_u32(lo), vmovn_u32(hi)));
+    }
+}
+#endif
+
+#ifdef SBUS_CODEC_AVX2
+/*
+ * Same layout as the NEON version: both 11 byte groups are loaded into
+ * the two 128 bit lanes, gathered with an in-lane byte shuffle and
+ * shifted per 32 bit lane.
+ */
+__attribute__((target("avx2")))
+static void unpack_avx2(const uint8_t *payload, uint16_t *channels)
+{
+    uint8_t p[SBUS_PAD_LEN] = { 0 };
+    const __m256i mask = _mm256_set1_epi32(SBUS_CHANNEL_MASK);
+    const __m256i idx_lo = _mm256_setr_epi8(0, 1, 2, -1, 1, 2, 3, -1, 2, 3, 4, -1, 4, 5, 6, -1,
+                                            0, 1, 2, -1, 1, 2, 3, -1, 2, 3, 4, -1, 4, 5, 6, -1);
+    const __m256i idx_hi = _mm256_setr_epi8(5, 6, 7, -1, 6, 7, 8, -1, 8, 9, 10, -1, 9, 10, 11, -1,
+                                            5, 6, 7, -1, 6, 7, 8, -1, 8, 9, 10, -1, 9, 10, 11, -1);
+    const __m256i shift_lo = _mm256_setr_epi32(0, 3, 6, 1, 0, 3, 6, 1);
+    const __m256i shift_hi = _mm256_setr_epi32(4, 7, 2, 5, 4, 7, 2, 5);
+    __m256i src, lo, hi, packed;
+
+    memcpy(p, payload, SBUS_PAYLOAD_LEN);
+
+    /* lane 0 holds channels 1-8, lane 1 channels 9-16 */
+    src = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                  _mm_loadu_si128((const __m128i *)(p + 11)), 1);
+    lo = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(src, idx_lo), shift_lo), mask);
+    hi = _mm256_and_si256(_mm256_srlv_epi32(_mm256_shuffle_epi8(src, idx_hi), shift_hi), mask);
+
+    /* packus interleaves per lane: lo[0-3] hi[0-3] | lo[4-7] hi[4-7] */
+    packed = _mm256_packus_epi32(lo, hi);
+    _mm256_storeu_si256((__m256i *)channels, packed);
+}
+#endif
+
+#ifdef SBUS_CODEC_SSE2
+/*
+ * SSE2 has neither a byte shuffle nor per lane shifts. Channel k of a
+ * group starts at bit 11k, inside the 16 bit word j = 11k / 16 at shift
+ * s = 11k % 16. Word shuffles line up word j and word j + 1 of every
+ * channel, and multiplying both by 2^(16 - s) does the 32 bit right
+ * shift: the high half of w[j] * m plus the low half of w[j + 1] * m.
+ * Channel 0 has no shift and takes m = 1 with w[0] in place of w[1].
+ */
+static void unpack_sse2(const uint8_t *payload, uint16_t *channels)
+{
+    uint8_t p[SBUS_PAD_LEN] = { 0 };
+    const __m128i mask = _mm_set1_epi16(SBUS_CHANNEL_MASK);
+    const __m128i mul = _mm_setr_epi16(1, 1 << 5, 1 << 10, (short)(1 << 15), 1 << 4, 1 << 9, 1 << 14, 1 << 3);
+    __m128i src, lo, hi;
+
+    memcpy(p, payload, SBUS_PAYLOAD_LEN);
+
+    for (int g = 0; g < 2; g++) {
+        /* words w0 w1 w2 w3 w2 w3 w4 w5 */
+        src = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(p + g * 11)), _MM_SHUFFLE(2, 1, 1, 0));
+        /* w0 w0 w1 w2 w2 w3 w4 w4 */
+        lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, _MM_SHUFFLE(2, 1, 0, 0)), _MM_SHUFFLE(2, 2, 1, 0));
+        /* w0 w1 w2 w3 w3 w4 w5 w5 */
+        hi = _mm_shufflehi_epi16(src, _MM_SHUFFLE(3, 3, 2, 1));
+
+        src = _mm_or_si128(_mm_mulhi_epu16(lo, mul), _mm_mullo_epi16(hi, mul));
+        _mm_storeu_si128((__m128i *)(channels + g * 8), _mm_and_si128(src, mask));
+    }
+}
+#endif
+
+static bool check_unpack(sbus_unpack_fn fn)
+{
+    uint8_t payload[SBUS_PAYLOAD_LEN];
+    uint16_t expected[SBUS_CHANNELS], actual[SBUS_CHANNELS];
+    uint32_t seed = 0x12345678;
+
+    for (int n = 0; n < SBUS_CHECK_FRAMES; n++) {
+        for (int i = 0; i < SBUS_PAYLOAD_LEN; i++) {
+            /* all zero and all one frames first, then pseudo random ones */
+            if (n < 2) {
+                payload[i] = n ? 0xff : 0x00;
+            } else {
+                seed = seed * 1103515245 + 12345;
+                payload[i] = seed >> 16;
+            }
+        }
+
+        unpack_scalar(payload, expected);
+        fn(payload, actual);
+        if (memcmp(expected, actual, sizeof(expected)))
+            return false;
+    }
+
+    return true;
+}
+
+static sbus_unpack_fn sUnpack = unpack_scalar;
+static const char *sUnpackName = "scalar";
+
+size_t sbus_codec_impls(const struct sbus_codec_impl **impls)
+{
+    static struct sbus_codec_impl usable[4];
+    size_t count = 0;
+
+    usable[count++] = { "scalar", unpack_scalar };
+#ifdef SBUS_CODEC_NEON
+    usable[count++] = { "neon", unpack_neon };
+#endif
+#ifdef SBUS_CODEC_SSE2
+    usable[count++] = { "sse2", unpack_sse2 };
+#endif
+#ifdef SBUS_CODEC_AVX2
+    if (__builtin_cpu_supports("avx2"))
+        usable[count++] = { "avx2", unpack_avx2 };
+#endif
+    *impls = usable;
+
+    return count;
+}
+
+/* the last usable implementation is the preferred one */
+void sbus_codec_init(void)
+{
+    const struct sbus_codec_impl *impls;
+    size_t count = sbus_codec_impls(&impls);
+
+    for (size_t i = count; i-- > 1; ) {
+        if (check_unpack(impls[i].unpack)) {
+            sUnpack = impls[i].unpack;
+            sUnpackName = impls[i].name;
+            break;
+        }
+        ALOGE("sbus codec: %s unpack mismatch\n", impls[i].name);
+    }
+
+    ALOGI("sbus codec: using %s unpack\n", sUnpackName);
+}
+
+void sbus_pack(const uint16_t channels[SBUS_CHANNELS], uint8_t payload[SBUS_PAYLOAD_LEN])
+{
+    uint32_t acc = 0;
+    int bits = 0;
+
+    /* 16 x 11 bit fill exactly 22 bytes */
+    for (int i = 0; i < SBUS_CHANNELS; i++) {
+        acc |= (uint32_t)(channels[i] & SBUS_CHANNEL_MASK) << bits;
+        bits += 11;
+        while (bits >= 8) {
+            *payload++ = acc & 0xff;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+}
+
+void sbus_unpack(const uint8_t payload[SBUS_PAYLOAD_LEN], uint16_t channels[SBUS_CHANNELS])
+{
+    sUnpack(payload, channels);
+}
+
+void sbus_pack_frames(const uint16_t (*channels)[SBUS_CHANNELS], uint8_t (*frames)[25], size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+        sbus_pack(channels[i], frames[i] + 1);
+}
+
+void sbus_unpack_frames(const uint8_t (*frames)[25], uint16_t (*channels)[SBUS_CHANNELS], size_t count)
+{
+    sbus_unpack_fn fn = sUnpack;
+
+    for (size_t i = 0; i < count; i++)
+        fn(frames[i] + 1, channels[i]);
+}
+
+const char *sbus_codec_name(void)
+{
+    return sUnpackName;
+}
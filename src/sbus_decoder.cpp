@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include "sbus_decoder.h"
+
+#define SBUS_FLAGS_POS     (SBUS_DATA_LEN - 2)
+/* frame lost, failsafe and the two digital channels, the rest is reserved */
+#define SBUS_FLAGS_RESERVED 0xf0
+
+#define RING_MASK (SBUS_DECODER_RING_SIZE - 1)
+
+SbusDecoder::SbusDecoder()
+{
+    reset();
+    mFrames = 0;
+    mDiscarded = 0;
+}
+
+void SbusDecoder::reset()
+{
+    mHead = 0;
+    mCount = 0;
+}
+
+size_t SbusDecoder::push(const uint8_t *data, size_t len)
+{
+    size_t tail, chunk, taken = 0;
+
+    if (len > SBUS_DECODER_RING_SIZE - mCount)
+        len = SBUS_DECODER_RING_SIZE - mCount;
+
+    /* at most two copies, before and after the wrap */
+    while (taken < len) {
+        tail = (mHead + mCount) & RING_MASK;
+        chunk = SBUS_DECODER_RING_SIZE - tail;
+        if (chunk > len - taken)
+            chunk = len - taken;
+        memcpy(mRing + tail, data + taken, chunk);
+        mCount += chunk;
+        taken += chunk;
+    }
+
+    return taken;
+}
+
+bool SbusDecoder::frameAtHead() const
+{
+    return at(0) == SBUS_STARTBYTE && at(SBUS_DATA_LEN - 1) == SBUS_ENDBYTE &&
+           !(at(SBUS_FLAGS_POS) & SBUS_FLAGS_RESERVED);
+}
+
+bool SbusDecoder::next(uint8_t frame[SBUS_DATA_LEN])
+{
+    size_t first;
+
+    while (mCount >= SBUS_DATA_LEN) {
+        if (!frameAtHead()) {
+            /* skip to the next start byte candidate */
+            do {
+                mHead = (mHead + 1) & RING_MASK;
+                mCount--;
+                mDiscarded++;
+            } while (mCount && at(0) != SBUS_STARTBYTE);
+            continue;
+        }
+
+        first = SBUS_DECODER_RING_SIZE - mHead;
+        if (first >= SBUS_DATA_LEN) {
+            memcpy(frame, mRing + mHead, SBUS_DATA_LEN);
+        } else {
+            memcpy(frame, mRing + mHead, first);
+            memcpy(frame + first, mRing, SBUS_DATA_LEN - first);
+        }
+        mHead = (mHead + SBUS_DATA_LEN) & RING_MASK;
+        mCount -= SBUS_DATA_LEN;
+        mFrames++;
+        return true;
+    }
+
+    return false;
+}
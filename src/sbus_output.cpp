@@ -0,0 +1,438 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "service.h"
+#include "rc_utils.h"
+#include "sbus_output.h"
+
+#define NSEC_PER_SEC 1000000000LL
+#define STATS_INTERVAL_NS (10 * NSEC_PER_SEC)
+
+/* loop gains of the arrival pll for phase and period */
+#define PLL_KP 0.25
+#define PLL_KI 0.05
+/* locked after PLL_LOCK_COUNT arrivals within PLL_LOCK_NS of the prediction */
+#define PLL_LOCK_NS 500000
+#define PLL_LOCK_COUNT 8
+#define PLL_UNLOCK_NS 2000000
+/* lost lock once no frame arrived for this many arrival periods */
+#define PLL_TIMEOUT_PERIODS 4
+/* largest shift of a single output deadline, as a fraction of the period */
+#define PLL_MAX_SLEW_DIV 8
+
+/* upper bounds of the lateness histogram buckets, the last bucket is open */
+const int64_t SbusOutput::sHistLimitsNs[HIST_BUCKETS - 1] = {
+    50000, 100000, 250000, 500000, 1000000, 2000000, 5000000
+};
+
+SbusOutput::SbusOutput(const char *name, long periodNs, int priority, OutputFunc func, void *arg)
+    : mName(name)
+    , mPeriodNs(periodNs)
+    , mPriority(priority)
+    , mFunc(func)
+    , mArg(arg)
+    , mMode(MODE_TIMER)
+    , mMinGapNs(periodNs)
+    , mPhaseOffsetNs(0)
+    , mArrivalNs(0)
+    , mTimerFd(-1)
+    , mEventFd(-1)
+    , mEpollFd(-1)
+    , mRunning(false)
+    , mDeadline(0)
+    , mLastWriteNs(0)
+    , mLastStatsNs(0)
+    , mTicks(0)
+    , mArrivalWrites(0)
+    , mOverruns(0)
+    , mMaxLateNs(0)
+    , mPllLastArrivalNs(0)
+    , mPllNextNs(0)
+    , mPllPeriodNs(0)
+    , mPllPhaseErrNs(0)
+    , mAlignErrNs(0)
+    , mPllGoodCount(0)
+    , mPllLocked(false)
+{
+    memset(mHistogram, 0, sizeof(mHistogram));
+}
+
+SbusOutput::~SbusOutput()
+{
+    stop();
+}
+
+void SbusOutput::setMode(OutputMode mode, long minGapNs)
+{
+    mMode = mode;
+    mMinGapNs = minGapNs;
+}
+
+void SbusOutput::setPhaseOffset(long offsetNs)
+{
+    mPhaseOffsetNs = offsetNs;
+}
+
+int SbusOutput::start()
+{
+    struct itimerspec ts;
+    epoll_data_t data;
+
+    mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mTimerFd < 0 || mEventFd < 0 || mEpollFd < 0) {
+        ALOGE("%s: create output fds failed, err:%s\n", mName.c_str(), strerror(errno));
+        goto failed;
+    }
+
+    data.fd = mTimerFd;
+    if (add_epoll_fd(mEpollFd, mTimerFd, data) < 0)
+        goto failed;
+    data.fd = mEventFd;
+    if (add_epoll_fd(mEpollFd, mEventFd, data) < 0)
+        goto failed;
+
+    /* first frame goes out one second after start, as before */
+    mDeadline = monotonic_ns() + NSEC_PER_SEC;
+    mLastStatsNs = mDeadline;
+    if (mMode == MODE_TIMER) {
+        ns_to_timespec(mDeadline, &ts.it_value);
+        ns_to_timespec(mPeriodNs, &ts.it_interval);
+        if (timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &ts, NULL) < 0) {
+            ALOGE("%s: arm timerfd failed, err:%s\n", mName.c_str(), strerror(errno));
+            goto failed;
+        }
+    } else if (!armTimer(mDeadline)) {
+        goto failed;
+    }
+
+    mRunning = true;
+    if (createThread(mPriority > 0))
+        return 0;
+
+    /* the service still works without realtime scheduling, just with more jitter */
+    if (mPriority > 0) {
+        ALOGW("%s: realtime priority %d not permitted, using default scheduling\n", mName.c_str(), mPriority);
+        if (createThread(false))
+            return 0;
+    }
+
+    ALOGE("%s: create output thread failed\n", mName.c_str());
+    mRunning = false;
+
+failed:
+    closeFds();
+    return -1;
+}
+
+void SbusOutput::stop()
+{
+    uint64_t one = 1;
+
+    if (!mRunning)
+        return;
+
+    mRunning = false;
+    if (write(mEventFd, &one, sizeof(one)) < 0)
+        ALOGW("%s: wake output thread failed, err:%s\n", mName.c_str(), strerror(errno));
+    pthread_join(mThread, NULL);
+
+    closeFds();
+}
+
+void SbusOutput::notify()
+{
+    uint64_t one = 1;
+
+    /* the pll only samples the arrival time on its next tick */
+    if (mMode == MODE_PLL) {
+        mArrivalNs.store(monotonic_ns(), std::memory_order_release);
+        return;
+    }
+
+    /* eventfd accumulates, so a burst of frames costs a single wakeup */
+    if (mMode == MODE_ARRIVAL && write(mEventFd, &one, sizeof(one)) < 0)
+        ALOGW("%s: notify output thread failed, err:%s\n", mName.c_str(), strerror(errno));
+}
+
+void SbusOutput::closeFds()
+{
+    if (mEpollFd >= 0)
+        close(mEpollFd);
+    if (mEventFd >= 0)
+        close(mEventFd);
+    if (mTimerFd >= 0)
+        close(mTimerFd);
+
+    mEpollFd = mEventFd = mTimerFd = -1;
+}
+
+bool SbusOutput::createThread(bool realtime)
+{
+    pthread_attr_t attr;
+    struct sched_param param;
+    int res;
+
+    pthread_attr_init(&attr);
+    if (realtime) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = mPriority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    res = pthread_create(&mThread, &attr, threadLoop, (void *)this);
+    pthread_attr_destroy(&attr);
+
+    return res == 0;
+}
+
+bool SbusOutput::armTimer(int64_t deadline)
+{
+    struct itimerspec ts;
+
+    memset(&ts, 0, sizeof(ts));
+    ns_to_timespec(deadline, &ts.it_value);
+    if (timerfd_settime(mTimerFd, TFD_TIMER_ABSTIME, &ts, NULL) < 0) {
+        ALOGE("%s: arm timerfd failed, err:%s\n", mName.c_str(), strerror(errno));
+        return false;
+    }
+    mDeadline = deadline;
+
+    return true;
+}
+
+void *SbusOutput::threadLoop(void *arg)
+{
+    SbusOutput *output = (SbusOutput *)arg;
+    struct epoll_event events[2];
+    int64_t now;
+    int i, n;
+
+    while (output->mRunning) {
+        n = epoll_wait(output->mEpollFd, events, 2, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                ALOGE("%s: epoll wait failed, err:%s\n", output->mName.c_str(), strerror(errno));
+            continue;
+        }
+        if (!output->mRunning)
+            break;
+        now = monotonic_ns();
+
+        /* serve a new frame first, a timer expiry racing with it is then re-armed */
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == output->mEventFd)
+                output->handleArrival(now);
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd == output->mTimerFd)
+                output->handleTimer(now);
+        }
+
+        if (now - output->mLastStatsNs >= STATS_INTERVAL_NS) {
+            output->dumpStats();
+            output->mLastStatsNs = now;
+        }
+    }
+
+    return NULL;
+}
+
+void SbusOutput::handleTimer(int64_t now)
+{
+    uint64_t expirations;
+    int64_t deadline;
+
+    /* nothing to read when the timer was re-armed after the wakeup */
+    if (read(mTimerFd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    /* with several expirations pending only the latest deadline is served */
+    deadline = mDeadline + (int64_t)(expirations - 1) * mPeriodNs;
+    if (mMode == MODE_TIMER) {
+        mDeadline = deadline + mPeriodNs;
+        mFunc(mArg);
+        mLastWriteNs = monotonic_ns();
+    } else if (mMode == MODE_PLL) {
+        mFunc(mArg);
+        mLastWriteNs = monotonic_ns();
+        updatePll(now);
+        armTimer(alignDeadline(deadline + mPeriodNs, now));
+    } else if (monotonic_ns() - mLastWriteNs < mMinGapNs) {
+        /* a late write pushed this repeat too close, keep the gap */
+        armTimer(mLastWriteNs + mMinGapNs);
+        return;
+    } else {
+        writeFrame(deadline);
+    }
+    recordTick(now - deadline, expirations);
+}
+
+void SbusOutput::handleArrival(int64_t now)
+{
+    uint64_t count;
+
+    if (read(mEventFd, &count, sizeof(count)) != sizeof(count))
+        return;
+
+    if (mMode != MODE_ARRIVAL)
+        return;
+
+    if (monotonic_ns() - mLastWriteNs >= mMinGapNs) {
+        writeFrame(now);
+        mArrivalWrites++;
+    } else if (mLastWriteNs + mMinGapNs < mDeadline) {
+        /* too close to the previous frame, send it once the gap has passed */
+        armTimer(mLastWriteNs + mMinGapNs);
+    }
+}
+
+void SbusOutput::writeFrame(int64_t base)
+{
+    mFunc(mArg);
+    /* measured after the write returns, so preemption can't shrink the gap */
+    mLastWriteNs = monotonic_ns();
+
+    /* repeat the frame one period later unless a new one arrives first */
+    armTimer(base + mPeriodNs);
+}
+
+void SbusOutput::updatePll(int64_t now)
+{
+    int64_t arrival = mArrivalNs.load(std::memory_order_acquire);
+    int64_t prev = mPllLastArrivalNs;
+    int64_t expected, err;
+    double cycles;
+
+    if (arrival == prev) {
+        if (mPllLocked && now - arrival > PLL_TIMEOUT_PERIODS * mPllPeriodNs) {
+            ALOGI("%s: pll unlocked, no frames\n", mName.c_str());
+            mPllLocked = false;
+            mPllGoodCount = 0;
+        }
+        return;
+    }
+    mPllLastArrivalNs = arrival;
+
+    if (prev == 0)
+        return;
+    if (mPllPeriodNs <= 0) {
+        mPllPeriodNs = arrival - prev;
+        mPllNextNs = arrival + (int64_t)mPllPeriodNs;
+        return;
+    }
+
+    /* match the arrival to its predicted slot, lost frames skip slots */
+    cycles = floor((arrival - mPllNextNs) / mPllPeriodNs + 0.5);
+    if (cycles < 0) {
+        /* arrived before the slot already passed, estimate again */
+        mPllPeriodNs = 0;
+        mPllLocked = false;
+        mPllGoodCount = 0;
+        return;
+    }
+    expected = mPllNextNs + (int64_t)(cycles * mPllPeriodNs);
+    err = arrival - expected;
+    mPllPhaseErrNs = err;
+
+    mPllNextNs = expected + (int64_t)(mPllPeriodNs + PLL_KP * err);
+    mPllPeriodNs += PLL_KI * err / (cycles + 1);
+
+    if (llabs(err) < PLL_LOCK_NS) {
+        if (!mPllLocked && ++mPllGoodCount >= PLL_LOCK_COUNT) {
+            ALOGI("%s: pll locked, arrival period:%lldus\n", mName.c_str(), (long long)(mPllPeriodNs / 1000));
+            mPllLocked = true;
+        }
+    } else if (llabs(err) > PLL_UNLOCK_NS) {
+        if (mPllLocked)
+            ALOGI("%s: pll unlocked, phase error:%lldus\n", mName.c_str(), (long long)(err / 1000));
+        mPllLocked = false;
+        mPllGoodCount = 0;
+    }
+}
+
+int64_t SbusOutput::alignDeadline(int64_t deadline, int64_t now)
+{
+    int64_t arrival, slew = mPeriodNs / PLL_MAX_SLEW_DIV;
+    double err;
+
+    if (!mPllLocked)
+        return deadline;
+
+    /* next expected arrival */
+    arrival = mPllNextNs;
+    if (arrival < now)
+        arrival += (int64_t)(ceil((now - arrival) / mPllPeriodNs) * mPllPeriodNs);
+
+    /* distance of the wanted write to the closest output tick */
+    err = arrival + mPhaseOffsetNs - deadline;
+    err -= floor(err / mPeriodNs + 0.5) * mPeriodNs;
+    mAlignErrNs = (int64_t)err;
+
+    if (err > slew)
+        err = slew;
+    else if (err < -slew)
+        err = -slew;
+    deadline += (int64_t)err;
+
+    if (deadline < mLastWriteNs + mMinGapNs)
+        deadline = mLastWriteNs + mMinGapNs;
+
+    return deadline;
+}
+
+void SbusOutput::recordTick(int64_t lateNs, uint64_t expirations)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        if (lateNs < sHistLimitsNs[i])
+            break;
+    }
+    mHistogram[i]++;
+
+    if (lateNs > mMaxLateNs)
+        mMaxLateNs = lateNs;
+    mOverruns += expirations - 1;
+    mTicks++;
+}
+
+void SbusOutput::dumpStats()
+{
+    ALOGI("%s: ticks:%llu, arrival writes:%llu, overruns:%llu, max late:%lldus, late <50us:%llu <100us:%llu <250us:%llu <500us:%llu <1ms:%llu <2ms:%llu <5ms:%llu >=5ms:%llu\n",
+          mName.c_str(), (unsigned long long)mTicks, (unsigned long long)mArrivalWrites,
+          (unsigned long long)mOverruns, (long long)(mMaxLateNs / 1000),
+          (unsigned long long)mHistogram[0], (unsigned long long)mHistogram[1],
+          (unsigned long long)mHistogram[2], (unsigned long long)mHistogram[3],
+          (unsigned long long)mHistogram[4], (unsigned long long)mHistogram[5],
+          (unsigned long long)mHistogram[6], (unsigned long long)mHistogram[7]);
+
+    if (mMode == MODE_PLL) {
+        ALOGI("%s: pll locked:%d, arrival period:%lldus, phase error:%lldus, align error:%lldus\n",
+              mName.c_str(), (int)mPllLocked, (long long)(mPllPeriodNs / 1000),
+              (long long)(mPllPhaseErrNs / 1000), (long long)(mAlignErrNs / 1000));
+    }
+
+    /* max lateness is reported per interval */
+    mMaxLateNs = 0;
+}
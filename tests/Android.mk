@@ -0,0 +1,25 @@
+LOCAL_PATH := $(call my-dir)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := rc_service_sbus_codec_test
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_SRC_FILES := sbus_codec_test.cpp \
+        ../src/sbus_codec.cpp
+LOCAL_STATIC_LIBRARIES := liblog
+LOCAL_CFLAGS := -DLOG_TAG=\"rc_service\"
+LOCAL_CPPFLAGS += -std=c++17
+
+include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := rc_service_sbus_codec_benchmark
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/../include
+LOCAL_SRC_FILES := sbus_codec_benchmark.cpp \
+        ../src/sbus_codec.cpp
+LOCAL_STATIC_LIBRARIES := liblog
+LOCAL_CFLAGS := -DLOG_TAG=\"rc_service\"
+LOCAL_CPPFLAGS += -std=c++17
+
+include $(BUILD_NATIVE_BENCHMARK)
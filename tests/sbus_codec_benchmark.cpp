@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <benchmark/benchmark.h>
+#include <stdlib.h>
+#include "sbus_codec.h"
+
+#define BENCH_FRAMES 1024
+
+static uint8_t sFrames[BENCH_FRAMES][25];
+static uint16_t sChannels[BENCH_FRAMES][SBUS_CHANNELS];
+
+static void fill_frames(void)
+{
+    srand(1);
+    for (int f = 0; f < BENCH_FRAMES; f++) {
+        for (int i = 0; i < SBUS_CHANNELS; i++)
+            sChannels[f][i] = rand() & 0x7ff;
+    }
+    sbus_pack_frames(sChannels, sFrames, BENCH_FRAMES);
+}
+
+static void BM_sbus_pack(benchmark::State &state)
+{
+    for (auto _ : state) {
+        sbus_pack_frames(sChannels, sFrames, BENCH_FRAMES);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * BENCH_FRAMES);
+}
+BENCHMARK(BM_sbus_pack);
+
+/* one run per unpack implementation the cpu supports */
+static void BM_sbus_unpack(benchmark::State &state)
+{
+    const struct sbus_codec_impl *impls;
+    const struct sbus_codec_impl *impl;
+
+    sbus_codec_impls(&impls);
+    impl = &impls[state.range(0)];
+    state.SetLabel(impl->name);
+
+    for (auto _ : state) {
+        for (int f = 0; f < BENCH_FRAMES; f++)
+            impl->unpack(sFrames[f] + 1, sChannels[f]);
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * BENCH_FRAMES);
+}
+
+static void unpack_args(benchmark::internal::Benchmark *b)
+{
+    const struct sbus_codec_impl *impls;
+    size_t count = sbus_codec_impls(&impls);
+
+    for (size_t i = 0; i < count; i++)
+        b->Arg(i);
+}
+BENCHMARK(BM_sbus_unpack)->Apply(unpack_args);
+
+int main(int argc, char **argv)
+{
+    fill_frames();
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+
+    return 0;
+}
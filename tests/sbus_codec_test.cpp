@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2019 FishSemi Inc. All rights reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sbus_codec.h"
+
+#define F(v, s) (((v) >> (s)) & 0x7ff)
+
+/* the hand written packing of pack_rc_msg() before the codec existed */
+static void legacy_pack(const uint16_t *c, uint8_t *d)
+{
+    d[0] = (c[0] & 0xff);
+    d[1] = (((c[0] >> 8) | (c[1] << 3)) & 0xff);
+    d[2] = (((c[1] >> 5) | (c[2] << 6)) & 0xff);
+    d[3] = ((c[2] >> 2) & 0xff);
+    d[4] = (((c[2] >> 10) | (c[3] << 1)) & 0xff);
+    d[5] = (((c[3] >> 7) | (c[4] << 4)) & 0xff);
+    d[6] = (((c[4] >> 4) | (c[5] << 7)) & 0xff);
+    d[7] = ((c[5] >> 1) & 0xff);
+    d[8] = (((c[5] >> 9) | (c[6] << 2)) & 0xff);
+    d[9] = (((c[6] >> 6) | (c[7] << 5)) & 0xff);
+    d[10] = (((c[7] >> 3)) & 0xff);
+
+    d[11] = (c[8] & 0xff);
+    d[12] = (((c[8] >> 8) | (c[9] << 3)) & 0xff);
+    d[13] = (((c[9] >> 5) | (c[10] << 6)) & 0xff);
+    d[14] = ((c[10] >> 2) & 0xff);
+    d[15] = (((c[10] >> 10) | (c[11] << 1)) & 0xff);
+    d[16] = (((c[11] >> 7) | (c[12] << 4)) & 0xff);
+    d[17] = (((c[12] >> 4) | (c[13] << 7)) & 0xff);
+    d[18] = ((c[13] >> 1) & 0xff);
+    d[19] = (((c[13] >> 9) | (c[14] << 2)) & 0xff);
+    d[20] = (((c[14] >> 6) | (c[15] << 5)) & 0xff);
+    d[21] = ((c[15] >> 3) & 0xff);
+}
+
+/* the hand written unpacking of BoardControl::parseSbusData() */
+static void legacy_unpack(const uint8_t *s, uint16_t *d)
+{
+    *d++ = F(s[0] | s[1] << 8, 0);
+    *d++ = F(s[1] | s[2] << 8, 3);
+    *d++ = F(s[2] | s[3] << 8 | s[4] << 16, 6);
+    *d++ = F(s[4] | s[5] << 8, 1);
+    *d++ = F(s[5] | s[6] << 8, 4);
+    *d++ = F(s[6] | s[7] << 8 | s[8] << 16, 7);
+    *d++ = F(s[8] | s[9] << 8, 2);
+    *d++ = F(s[9] | s[10] << 8, 5);
+
+    *d++ = F(s[11] | s[12] << 8, 0);
+    *d++ = F(s[12] | s[13] << 8, 3);
+    *d++ = F(s[13] | s[14] << 8 | s[15] << 16, 6);
+    *d++ = F(s[15] | s[16] << 8, 1);
+    *d++ = F(s[16] | s[17] << 8, 4);
+    *d++ = F(s[17] | s[18] << 8 | s[19] << 16, 7);
+    *d++ = F(s[19] | s[20] << 8, 2);
+    *d++ = F(s[20] | s[21] << 8, 5);
+}
+
+/* neighbours of the channel under test: all clear, all set, alternating */
+static const uint16_t sBackground[] = { 0x000, 0x7ff, 0x555, 0x2aa };
+
+class SbusCodecTest : public ::testing::Test {
+protected:
+    void SetUp() override
+    {
+        mCount = sbus_codec_impls(&mImpls);
+        srand(1);
+    }
+
+    const struct sbus_codec_impl *mImpls;
+    size_t mCount;
+};
+
+TEST_F(SbusCodecTest, PackMatchesLegacyForEveryChannelValue)
+{
+    uint16_t channels[SBUS_CHANNELS];
+    uint8_t expected[SBUS_PAYLOAD_LEN], actual[SBUS_PAYLOAD_LEN];
+
+    for (uint16_t bg : sBackground) {
+        for (int ch = 0; ch < SBUS_CHANNELS; ch++) {
+            for (uint16_t v = 0; v <= 0x7ff; v++) {
+                for (int i = 0; i < SBUS_CHANNELS; i++)
+                    channels[i] = bg;
+                channels[ch] = v;
+
+                legacy_pack(channels, expected);
+                sbus_pack(channels, actual);
+                ASSERT_EQ(0, memcmp(expected, actual, sizeof(expected)))
+                    << "channel " << ch << " value " << v << " background " << bg;
+            }
+        }
+    }
+}
+
+TEST_F(SbusCodecTest, UnpackMatchesLegacyForEveryChannelValue)
+{
+    uint16_t channels[SBUS_CHANNELS], expected[SBUS_CHANNELS], actual[SBUS_CHANNELS];
+    uint8_t payload[SBUS_PAYLOAD_LEN];
+
+    for (size_t n = 0; n < mCount; n++) {
+        for (uint16_t bg : sBackground) {
+            for (int ch = 0; ch < SBUS_CHANNELS; ch++) {
+                for (uint16_t v = 0; v <= 0x7ff; v++) {
+                    for (int i = 0; i < SBUS_CHANNELS; i++)
+                        channels[i] = bg;
+                    channels[ch] = v;
+
+                    legacy_pack(channels, payload);
+                    legacy_unpack(payload, expected);
+                    mImpls[n].unpack(payload, actual);
+                    ASSERT_EQ(0, memcmp(channels, expected, sizeof(channels)));
+                    ASSERT_EQ(0, memcmp(expected, actual, sizeof(expected)))
+                        << mImpls[n].name << " channel " << ch << " value " << v << " background " << bg;
+                }
+            }
+        }
+    }
+}
+
+TEST_F(SbusCodecTest, UnpackMatchesLegacyForRandomPayloads)
+{
+    uint16_t expected[SBUS_CHANNELS], actual[SBUS_CHANNELS];
+    uint8_t payload[SBUS_PAYLOAD_LEN];
+
+    for (int n = 0; n < 100000; n++) {
+        for (int i = 0; i < SBUS_PAYLOAD_LEN; i++)
+            payload[i] = rand();
+
+        legacy_unpack(payload, expected);
+        for (size_t k = 0; k < mCount; k++) {
+            mImpls[k].unpack(payload, actual);
+            ASSERT_EQ(0, memcmp(expected, actual, sizeof(expected))) << mImpls[k].name;
+        }
+    }
+}
+
+TEST_F(SbusCodecTest, PackMasksChannelsTo11Bit)
+{
+    uint16_t channels[SBUS_CHANNELS], masked[SBUS_CHANNELS], actual[SBUS_CHANNELS];
+    uint8_t payload[SBUS_PAYLOAD_LEN];
+
+    for (int i = 0; i < SBUS_CHANNELS; i++) {
+        channels[i] = 0xf800 | (i * 131);
+        masked[i] = channels[i] & 0x7ff;
+    }
+
+    sbus_pack(channels, payload);
+    legacy_unpack(payload, actual);
+    EXPECT_EQ(0, memcmp(masked, actual, sizeof(masked)));
+}
+
+TEST_F(SbusCodecTest, FramesRoundTrip)
+{
+    uint16_t channels[64][SBUS_CHANNELS], actual[64][SBUS_CHANNELS];
+    uint8_t frames[64][25];
+
+    for (int f = 0; f < 64; f++) {
+        for (int i = 0; i < SBUS_CHANNELS; i++)
+            channels[f][i] = rand() & 0x7ff;
+    }
+    memset(frames, 0xa5, sizeof(frames));
+
+    sbus_codec_init();
+    sbus_pack_frames(channels, frames, 64);
+    sbus_unpack_frames(frames, actual, 64);
+    EXPECT_EQ(0, memcmp(channels, actual, sizeof(channels)));
+
+    /* start, flag and end bytes are left alone */
+    for (int f = 0; f < 64; f++) {
+        EXPECT_EQ(0xa5, frames[f][0]);
+        EXPECT_EQ(0xa5, frames[f][23]);
+        EXPECT_EQ(0xa5, frames[f][24]);
+    }
+}